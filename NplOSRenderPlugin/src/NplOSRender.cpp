@@ -7,176 +7,1475 @@
 
 using namespace ParaEngine;
 
+/** a caller waiting for a job, identical requests share one job */
+struct RenderRequester
+{
+	std::string id;
+	std::string callName;
+	RenderCallback callBack;
+};
+
+/** a smaller copy of a job's sprite sheet, downsampled from it */
+struct RenderOutput
+{
+	std::string fileName;
+	int width;
+	int height;
+	std::vector<unsigned char> pngData;
+};
+
 struct RenderParams
 {
 	std::string modelName;
-	std::string callName;
+	/** output path, parameters and render list hash, used to detect identical requests */
+	std::string key;
+	std::vector<RenderRequester> requesters;
 	int width = 128;
 	int height = 128;
 	int frame = 8;
-	std::function<void(const string&, const string&)> callBack;
+	int priority = 0;
+	/** reorder indices and vertices for the vertex cache and overdraw, and cache the result per shape */
+	bool optimize = false;
+	/** merge vertices closer than this in position, normal and color, negative disables welding */
+	float weld = -1.0f;
+	/** simplify meshes with more triangles than output pixels */
+	bool lod = true;
+	/** draw all frames with one call on the shader path, if the sheet fits in a viewport and no worker is idle */
+	bool singlePass = false;
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+	unsigned long long sequence = 0;
+	size_t memoryCost = 0;
+	std::atomic<bool> cancelled;
 	NPLInterface::NPLObjectProxy renderList;
+	/** shared meshes of repeated parts by id, referenced by the mesh field of shapes */
+	NPLInterface::NPLObjectProxy meshes;
+	std::map<string, int> meshIds;
+
+	string error;
+	MeshData* mesh = nullptr;
+	// build state, kept across the chunks of a session
+	Vector3 boundsMin;
+	Vector3 boundsMax;
+	/** first vertex of each entry of mesh->shapes */
+	std::vector<size_t> shapeStarts;
+	/** FNV-1a of the render list, or of all chunks of a session */
+	unsigned long long contentHash = 14695981039346656037ULL;
+	/** an open session is dropped with error "expired" when no message arrives for it before this */
+	std::chrono::steady_clock::time_point sessionExpires;
+	std::vector<unsigned char> pngData;
+	/** extra output sizes, largest first */
+	std::vector<RenderOutput> outputs;
+
+	// state shared by the workers rendering the frames of this job
+	GLuint listId = 0;
+	/** the job's list plus one list per instanced mesh */
+	GLsizei listCount = 1;
+	/** used instead of the display lists on the shader path */
+	MeshBuffers buffers;
+	Vector3 center;
+	GLfloat scale = 1.0f;
+	GLubyte* bigBuffer = nullptr;
+	/** supersampling factor: each frame is rendered at aa times the size, then filtered down into its cell of bigBuffer */
+	int aa = 1;
+	/** frames are drawn in a context running Mesa's MLAA post-process filter, which smooths edges when they are read back */
+	bool mlaa = false;
+	std::atomic<int> nextFrame;
+	int helpers = 0;
+	/** the pool of the worker rendering the job, only workers of that pool share its buffers */
+	int pool = 0;
+
+	RenderParams(const std::string& name, const NPLInterface::NPLObjectProxy& r)
+		:modelName(name), cancelled(false), renderList(r), boundsMin(0, 0, 0), boundsMax(0, 0, 0), nextFrame(0) {}
+	/** bytes of the sprite sheet, all frames side by side */
+	size_t GetSheetSize() const { return (size_t)width * 4 * height * frame; }
+	int GetRenderWidth() const { return width * aa; }
+	int GetRenderHeight() const { return height * aa; }
+	/** bytes of one frame at the render size */
+	size_t GetRenderFrameSize() const { return (size_t)GetRenderWidth() * 4 * GetRenderHeight(); }
+	~RenderParams()
+	{
+		delete mesh;
+		delete[] bigBuffer;
+	}
+};
+
+/** an activation message waiting to be parsed */
+struct RenderMessage
+{
+	string msg;
+	RenderCallback callBack;
+	std::chrono::steady_clock::time_point received;
 
-	RenderParams(const std::string& name, const NPLInterface::NPLObjectProxy& r, std::function<void(const string&, const string&)>& cb)
-		:modelName(name), renderList(r), callBack(cb) {}
+	RenderMessage(const char* data, int length, RenderCallback& cb)
+		:msg(data, length), callBack(cb), received(std::chrono::steady_clock::now()) {}
 };
 
+/** a message of a streamed job, applied in arrival order by the session thread */
+struct SessionMessage
+{
+	string sessionId;
+	NPLInterface::NPLObjectProxy tabMsg;
+	/** the job of an opening message, nullptr for the messages that follow */
+	RenderParams* params;
+	/** set instead of sessionId to cancel the sessions of a requester id */
+	string cancelId;
+
+	SessionMessage(const string& id, const NPLInterface::NPLObjectProxy& msg, RenderParams* p)
+		:sessionId(id), tabMsg(msg), params(p) {}
+	~SessionMessage() { delete params; }
+};
+
+/** open sessions expire after this long without a message */
+static const std::chrono::seconds SessionTimeout(60);
+/** geometry all open sessions may hold together when there is no memory budget */
+static const size_t DefaultSessionBytes = (size_t)1024 * 1024 * 1024;
+
+bool RenderParamsOrder::operator()(const RenderParams* a, const RenderParams* b) const
+{
+	if (a->priority != b->priority)
+		return a->priority > b->priority;
+	if (a->deadline != b->deadline)
+		return a->deadline < b->deadline;
+	return a->sequence < b->sequence;
+}
+
+/** job ids may be given either as strings or as numbers */
+static string GetJobId(NPLInterface::NPLObjectProxy& value)
+{
+	if (value.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_Number)
+	{
+		char id[32];
+		snprintf(id, sizeof(id), "%.0f", (double)value);
+		return id;
+	}
+	if (value.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_String)
+		return (const string&)value;
+	return "";
+}
+
+static void NotifyRequesters(const string& fileName, const std::vector<RenderRequester>& requesters, const string& error)
+{
+	for (auto& requester : requesters)
+		requester.callBack(fileName, requester.callName, error);
+}
+
+/** FNV-1a over the content of a NPL object, table fields are visited in key order */
+static void HashNPLObject(NPLInterface::NPLObjectProxy& value, unsigned long long& hash)
+{
+	auto mix = [&hash](const void* data, size_t size) {
+		const unsigned char* bytes = (const unsigned char*)data;
+		for (size_t i = 0; i < size; i++)
+		{
+			hash ^= bytes[i];
+			hash *= 1099511628211ULL;
+		}
+	};
+	NPLInterface::NPLObjectBase::NPLObjectType type = value.GetType();
+	mix(&type, sizeof(type));
+	if (type == NPLInterface::NPLObjectBase::NPLObjectType_Number)
+	{
+		double number = value;
+		mix(&number, sizeof(number));
+	}
+	else if (type == NPLInterface::NPLObjectBase::NPLObjectType_String)
+	{
+		const string& str = value;
+		mix(str.c_str(), str.size() + 1);
+	}
+	else if (type == NPLInterface::NPLObjectBase::NPLObjectType_Bool)
+	{
+		bool b = value;
+		mix(&b, sizeof(b));
+	}
+	else if (type == NPLInterface::NPLObjectBase::NPLObjectType_Table)
+	{
+		for (NPLInterface::NPLTable::IndexIterator_Type itCur = value.index_begin(), itEnd = value.index_end(); itCur != itEnd; ++itCur)
+		{
+			mix(&itCur->first, sizeof(itCur->first));
+			HashNPLObject(itCur->second, hash);
+		}
+		for (NPLInterface::NPLTable::Iterator_Type itCur = value.begin(), itEnd = value.end(); itCur != itEnd; ++itCur)
+		{
+			mix(itCur->first.c_str(), itCur->first.size() + 1);
+			HashNPLObject(itCur->second, hash);
+		}
+	}
+}
+
 NplOSRender* NplOSRender::m_pInstance = nullptr;
 NplOSRender::NplOSRender()
-	:m_pThread(nullptr)
+	:m_pParseThread(nullptr)
+	, m_pSessionThread(nullptr)
+	, m_pBuildThread(nullptr)
+	, m_nPool(0)
+	, m_nWorkersStarted(0)
+	, m_pEncodeThread(nullptr)
+	, m_pWriteThread(nullptr)
+	, m_nWorkerCount(std::max(1, (int)std::thread::hardware_concurrency()))
+	, m_bShaders(true)
+	, m_bUseShaders(true)
+	, m_inbox((size_t)-1)
+	, m_encodeQueue(2)
+	, m_writeQueue(4)
+	, m_nSequence(0)
+	, m_nMaxQueue(0)
+	, m_nMemoryBudget(0)
+	, m_nMemoryInUse(0)
+	, m_sheetPool(256 * 1024 * 1024)
+	, m_shapeCache(128 * 1024 * 1024)
+	, m_nWarmup(0)
+	, m_sessionInbox((size_t)-1)
 	, m_start(false)
-	, m_context(OSMesaCreateContextExt(OSMESA_RGBA, 32, 8, 16, nullptr))
 {
-	if (!m_context) {
-		printf("OSMesaCreateContext failed!\n");
-	}
 }
 
 NplOSRender::~NplOSRender()
 {
-	if (m_pThread != nullptr)
+	// stop parsing first, so that no new job can restart the workers
+	m_inbox.Close();
+	if (m_pParseThread != nullptr)
 	{
+		m_pParseThread->join();
+		delete m_pParseThread;
+		m_pParseThread = nullptr;
+	}
+	// then the sessions, a committed session queues a job
+	m_sessionInbox.Close();
+	if (m_pSessionThread != nullptr)
+	{
+		m_pSessionThread->join();
+		delete m_pSessionThread;
+		m_pSessionThread = nullptr;
+	}
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
 		m_start = false;
-		lock_guard<mutex> lock(m_mutex);
-		m_queue.push(nullptr);
-		m_condition.notify_one();
-		m_pThread->join();
-		
-		RenderParams* params;
-		while (!m_queue.empty())
-		{
-			params = m_queue.front();
-			m_queue.pop();
+		m_condition.notify_all();
+	}
+	m_encodeQueue.Close();
+	m_writeQueue.Close();
+
+	// workers destroy their own contexts as they leave
+	std::vector<RenderWorker*> workers(m_workers);
+	workers.insert(workers.end(), m_retiredWorkers.begin(), m_retiredWorkers.end());
+	for (auto worker : workers)
+	{
+		worker->thread->join();
+		delete worker->thread;
+		delete worker;
+	}
+	m_workers.clear();
+	m_retiredWorkers.clear();
+
+	std::vector<std::thread*> threads;
+	threads.push_back(m_pBuildThread);
+	threads.push_back(m_pEncodeThread);
+	threads.push_back(m_pWriteThread);
+	for (auto thread : threads)
+	{
+		if (thread != nullptr)
+		{
+			thread->join();
+			delete thread;
+		}
+	}
+	m_pBuildThread = m_pEncodeThread = m_pWriteThread = nullptr;
+
+	for (auto message : m_inbox.Drain())
+		delete message;
+	for (auto message : m_sessionInbox.Drain())
+		delete message;
+
+	for (auto params : m_queue)
+		delete params;
+	m_queue.clear();
+	for (auto params : m_rasterQueue)
+		delete params;
+	m_rasterQueue.clear();
+	for (auto params : m_encodeQueue.Drain())
+		delete params;
+	for (auto params : m_writeQueue.Drain())
+		delete params;
+	for (auto session : m_sessions)
+		delete session.second;
+	m_sessions.clear();
+	for (auto mesh : m_meshPool)
+		delete mesh;
+	m_meshPool.clear();
+}
+
+void NplOSRender::SetWorkerCount(int count)
+{
+	std::unique_lock<std::mutex> lk(m_mutex);
+	m_nWorkerCount = std::max(1, count);
+	if (!m_start)
+		return;
+	// new workers join the running pool, a smaller pool replaces it
+	if (m_nWorkerCount < (int)m_workers.size())
+		RestartWorkers();
+	else
+		StartWorkers();
+}
+
+void NplOSRender::RestartWorkers()
+{
+	// the old workers finish their current jobs and destroy their contexts themselves, so nothing waits for them here.
+	// Jobs waiting for a worker go to the new pool, which gets a share group of its own
+	ReapWorkers();
+	m_retiredWorkers.insert(m_retiredWorkers.end(), m_workers.begin(), m_workers.end());
+	m_workers.clear();
+	m_nPool++;
+	StartWorkers();
+	m_condition.notify_all();
+}
+
+void NplOSRender::ReapWorkers()
+{
+	// a finished worker only has to return from DoTask, so joining it does not block
+	for (auto it = m_retiredWorkers.begin(); it != m_retiredWorkers.end();)
+	{
+		RenderWorker* worker = *it;
+		if (!worker->finished)
+		{
+			++it;
+			continue;
+		}
+		worker->thread->join();
+		delete worker->thread;
+		delete worker;
+		it = m_retiredWorkers.erase(it);
+	}
+}
+
+void NplOSRender::SetMaxQueue(int maxQueue)
+{
+	std::unique_lock<std::mutex> lk(m_mutex);
+	m_nMaxQueue = std::max(0, maxQueue);
+}
+
+void NplOSRender::SetMemoryBudget(size_t memoryBudget)
+{
+	std::unique_lock<std::mutex> lk(m_mutex);
+	m_nMemoryBudget = memoryBudget;
+	// idle sheets never hold more memory than the jobs in flight may use
+	m_sheetPool.SetMaxRetained(memoryBudget > 0 ? std::min(memoryBudget, (size_t)256 * 1024 * 1024) : 256 * 1024 * 1024);
+	m_condition.notify_all();
+}
+
+void NplOSRender::StartWorkers()
+{
+	m_start = true;
+	if (m_pBuildThread == nullptr)
+	{
+		m_pBuildThread = new std::thread(&NplOSRender::BuildTask, this);
+		m_pEncodeThread = new std::thread(&NplOSRender::EncodeTask, this);
+		m_pWriteThread = new std::thread(&NplOSRender::WriteTask, this);
+	}
+	ReapWorkers();
+	for (int i = (int)m_workers.size(); i < m_nWorkerCount; i++)
+	{
+		// all contexts of a pool share display lists and buffers with its first one, so the frames of a job can be split across workers
+		OSMesaContext share = m_workers.empty() ? nullptr : m_workers[0]->context;
+		if (share == nullptr)
+			m_bShaders = m_bUseShaders;
+		OSMesaContext context = nullptr;
+		if (m_bShaders && ShaderAPI::Get() != nullptr)
+			context = CreateContext(share, true);
+		if (!context && share == nullptr && m_bShaders)
+		{
+			printf("no core profile context, rendering with fixed-function GL\n");
+			m_bShaders = false;
+		}
+		if (!m_bShaders)
+			context = CreateContext(share, false);
+		if (!context) {
+			printf("OSMesaCreateContext failed!\n");
+			break;
+		}
+		RenderWorker* worker = new RenderWorker();
+		worker->context = context;
+		worker->pool = m_nPool;
+		worker->shaders = m_bShaders;
+		worker->surface.assign((size_t)4 * ++m_nWorkersStarted, 0);
+		worker->thread = new std::thread(&NplOSRender::DoTask, this, worker);
+		m_workers.push_back(worker);
+	}
+}
+
+OSMesaContext NplOSRender::CreateContext(OSMesaContext share, bool shaders)
+{
+	if (shaders)
+	{
+		const int attribs[] = { OSMESA_FORMAT, OSMESA_RGBA, OSMESA_DEPTH_BITS, 32, OSMESA_STENCIL_BITS, 8,
+			OSMESA_PROFILE, OSMESA_CORE_PROFILE, OSMESA_CONTEXT_MAJOR_VERSION, 3, OSMESA_CONTEXT_MINOR_VERSION, 3, 0 };
+		return OSMesaCreateContextAttribs(attribs, share);
+	}
+	return OSMesaCreateContextExt(OSMESA_RGBA, 32, 8, 16, share);
+}
+
+OSMesaContext NplOSRender::CreateFilteredContext(const RenderWorker& worker)
+{
+	OSMesaContext context = CreateContext(worker.context, worker.shaders);
+	if (!context)
+	{
+		printf("OSMesaCreateContext failed, rendering without MLAA\n");
+		return nullptr;
+	}
+	// filters only take effect when set before the context is made current for the first time
+	OSMesaPostprocess(context, "pp_jimenezmlaa", 8);
+	return context;
+}
+
+void NplOSRender::SetUseShaders(bool enable)
+{
+	std::unique_lock<std::mutex> lk(m_mutex);
+	m_bUseShaders = enable;
+	// a running pool of the other kind is replaced, its workers finish their current jobs with the kind they have
+	if (m_start && !m_workers.empty() && m_bShaders != enable)
+		RestartWorkers();
+}
+
+void NplOSRender::PostTask(const char* msg, int length, RenderCallback cb)
+{
+	// only copy the message here, it is parsed on the parse thread so that the caller returns at once
+	std::call_once(m_parseOnce, [this]() { m_pParseThread = new std::thread(&NplOSRender::ParseTask, this); });
+	m_inbox.Push(new RenderMessage(msg, length, cb));
+}
+
+void NplOSRender::ParseTask()
+{
+	RenderMessage* message = nullptr;
+	while (m_inbox.Pop(message))
+	{
+		ParseMessage(*message);
+		delete message;
+		message = nullptr;
+	}
+}
+
+void NplOSRender::ParseMessage(RenderMessage& message)
+{
+	NPLInterface::NPLObjectProxy tabMsg = NPLInterface::NPLHelper::MsgStringToNPLTable(message.msg.c_str(), (int)message.msg.size());
+	string().swap(message.msg);
+	double workers = tabMsg["workers"];
+	if (workers > 0)
+		SetWorkerCount((int)workers);
+	// each limit is only changed when the message sets it, 0 removes it
+	NPLInterface::NPLObjectProxy& maxQueue = tabMsg["max_queue"];
+	if (maxQueue.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_Number)
+		SetMaxQueue((int)std::max(0.0, (double)maxQueue));
+	NPLInterface::NPLObjectProxy& memoryBudget = tabMsg["memory_budget"];
+	if (memoryBudget.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_Number)
+		SetMemoryBudget((size_t)std::max(0.0, (double)memoryBudget));
+	if (tabMsg["shaders"].GetType() == NPLInterface::NPLObjectBase::NPLObjectType_Bool)
+		SetUseShaders((bool)tabMsg["shaders"]);
+	if ((bool)tabMsg["warmup"])
+		Warmup();
+
+	string cancelId = GetJobId(tabMsg["cancel"]);
+	if (!cancelId.empty())
+	{
+		CancelTask(cancelId);
+		return;
+	}
+
+	// chunks of a streamed job
+	string sessionId = GetJobId(tabMsg["session"]);
+	if (!sessionId.empty() && !(bool)tabMsg["open"])
+	{
+		PostSessionMessage(new SessionMessage(sessionId, tabMsg, nullptr));
+		return;
+	}
+
+	string fileName = tabMsg["model"];
+	if (fileName.empty())
+		return;
+	size_t pos = fileName.find_last_of('.');
+	if (pos != string::npos)
+		fileName = fileName.substr(0, pos);
+	fileName.append(".png");
+	RenderParams* params = new RenderParams(fileName, tabMsg["render"]);
+	RenderRequester requester;
+	requester.id = GetJobId(tabMsg["id"]);
+	requester.callName = (const string&)tabMsg["callback"];
+	requester.callBack = message.callBack;
+	params->requesters.push_back(requester);
+	double w = tabMsg["width"];
+	double h = tabMsg["height"];
+	double f = tabMsg["frame"];
+	if (w > 0) params->width = (int)w;
+	if (h > 0) params->height = (int)h;
+	if (f > 0) params->frame = (int)f;
+	params->priority = (int)(double)tabMsg["priority"];
+	params->optimize = (bool)tabMsg["optimize"];
+	if (tabMsg["lod"].GetType() == NPLInterface::NPLObjectBase::NPLObjectType_Bool)
+		params->lod = (bool)tabMsg["lod"];
+	NPLInterface::NPLObjectProxy& weld = tabMsg["weld"];
+	if (weld.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_Bool)
+		params->weld = (bool)weld ? 0.0f : -1.0f;
+	else if (weld.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_Number)
+		params->weld = std::max(0.0f, (float)(double)weld);
+	double aa = tabMsg["aa"];
+	if (aa == 2 || aa == 4)
+		params->aa = (int)aa;
+	params->mlaa = (bool)tabMsg["mlaa"];
+	params->singlePass = (bool)tabMsg["single_pass"];
+	double deadline = tabMsg["deadline_ms"];
+	if (deadline > 0)
+		params->deadline = message.received + std::chrono::milliseconds((long long)deadline);
+
+	// the same frames at smaller widths, each written to "<model>_<width>.png"
+	NPLInterface::NPLObjectProxy& sizes = tabMsg["sizes"];
+	if (sizes.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_Table)
+	{
+		for (NPLInterface::NPLTable::IndexIterator_Type itCur = sizes.index_begin(), itEnd = sizes.index_end(); itCur != itEnd; ++itCur)
+		{
+			int size = (int)(double)itCur->second;
+			if (size <= 0 || size >= params->width)
+				continue;
+			RenderOutput output;
+			char suffix[32];
+			snprintf(suffix, sizeof(suffix), "_%d.png", size);
+			output.fileName = fileName.substr(0, fileName.size() - 4) + suffix;
+			output.width = size;
+			output.height = std::max(1, (int)((double)params->height * size / params->width + 0.5));
+			if (std::find_if(params->outputs.begin(), params->outputs.end(), [size](const RenderOutput& o) { return o.width == size; }) == params->outputs.end())
+				params->outputs.push_back(output);
+		}
+		std::sort(params->outputs.begin(), params->outputs.end(), [](const RenderOutput& a, const RenderOutput& b) { return a.width > b.width; });
+	}
+
+	// the sprite sheet of the job, frames are rendered straight into it, and the smaller sheets while they are encoded,
+	// charged at the size the buffer pool allocates for them
+	params->memoryCost = BufferPool::GetAllocationSize(params->GetSheetSize());
+	for (auto& output : params->outputs)
+		params->memoryCost += BufferPool::GetAllocationSize((size_t)output.width * output.height * 4 * params->frame);
+	if (params->aa > 1)
+	{
+		// with aa, one supersampled frame for each worker which may draw the job's frames at once
+		int workers;
+		{
+			std::unique_lock<std::mutex> lk(m_mutex);
+			workers = std::min(params->frame, m_nWorkerCount);
+		}
+		params->memoryCost += BufferPool::GetAllocationSize(params->GetRenderFrameSize()) * workers;
+	}
+
+	if (!sessionId.empty())
+	{
+		params->renderList.MakeNil();
+		PostSessionMessage(new SessionMessage(sessionId, tabMsg, params));
+		return;
+	}
+
+	params->meshes = tabMsg["meshes"];
+	HashNPLObject(params->meshes, params->contentHash);
+	HashNPLObject(params->renderList, params->contentHash);
+	QueueTask(params);
+}
+
+void NplOSRender::QueueTask(RenderParams* params)
+{
+	char key[128];
+	// everything that changes the geometry or the pixels, so that only requests for the same image share a job
+	snprintf(key, sizeof(key), "|%d|%d|%d|%d|%d|%d|%.9g|%d|%016llx", params->width, params->height, params->frame, params->aa, params->mlaa ? 1 : 0,
+		params->optimize ? 1 : 0, params->weld, params->lod ? 1 : 0, params->contentHash);
+	params->key = params->modelName + key;
+	for (auto& output : params->outputs)
+	{
+		snprintf(key, sizeof(key), "|%d", output.width);
+		params->key += key;
+	}
+	const RenderRequester requester = params->requesters.front();
+
+	std::unique_lock<std::mutex> lk(m_mutex);
+	auto pending = m_pending.find(params->key);
+	if (pending != m_pending.end() && !pending->second->cancelled)
+	{
+		// an identical job is queued or running, answer this request with its result
+		RenderParams* job = pending->second;
+		bool queued = m_queue.erase(job) > 0;
+		job->requesters.push_back(requester);
+		job->priority = std::max(job->priority, params->priority);
+		// the shared job is only dropped when every requester's deadline has passed
+		job->deadline = std::max(job->deadline, params->deadline);
+		if (queued)
+			m_queue.insert(job);
+		delete params;
+		return;
+	}
+
+	string error;
+	if (m_nMemoryBudget > 0 && params->memoryCost > m_nMemoryBudget)
+		error = "too_large";
+	else if (m_nMaxQueue > 0 && (int)m_queue.size() >= m_nMaxQueue)
+		error = "queue_full";
+	if (!error.empty())
+	{
+		lk.unlock();
+		NotifyRequesters(params->modelName, params->requesters, error);
+		delete params;
+		return;
+	}
+
+	if (!m_start)
+		StartWorkers();
+	// without a context no job could ever be rendered
+	if (m_workers.empty())
+	{
+		lk.unlock();
+		NotifyRequesters(params->modelName, params->requesters, "no_context");
+		delete params;
+		return;
+	}
+	params->sequence = m_nSequence++;
+	m_queue.insert(params);
+	m_pending[params->key] = params;
+	m_condition.notify_all();
+}
+
+bool NplOSRender::CanStartTask()
+{
+	if (m_queue.empty())
+		return false;
+	// the next job waits until the jobs in flight release enough memory
+	size_t cost = (*m_queue.begin())->memoryCost;
+	if (m_nMemoryBudget == 0)
+		return true;
+	if (m_nMemoryInUse > 0 && m_nMemoryInUse + cost > m_nMemoryBudget)
+		return false;
+	// idle pooled buffers are real memory too, free those the new job leaves no room for
+	m_sheetPool.TrimTo(m_nMemoryBudget - std::min(m_nMemoryBudget, m_nMemoryInUse + cost));
+	return true;
+}
+
+std::chrono::steady_clock::time_point NplOSRender::ExpireQueuedTasks(std::vector<RenderParams*>& expired)
+{
+	std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point nextDeadline = std::chrono::steady_clock::time_point::max();
+	for (auto it = m_queue.begin(); it != m_queue.end();)
+	{
+		RenderParams* params = *it;
+		if (params->deadline < now)
+		{
+			expired.push_back(params);
+			m_pending.erase(params->key);
+			it = m_queue.erase(it);
+		}
+		else
+		{
+			nextDeadline = std::min(nextDeadline, params->deadline);
+			++it;
+		}
+	}
+	return nextDeadline;
+}
+
+void NplOSRender::CancelTask(const string& id)
+{
+	std::vector<std::pair<string, RenderRequester> > cancelled;
+	std::vector<RenderParams*> removed;
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
+		auto removeRequesters = [&](RenderParams* params) {
+			auto& requesters = params->requesters;
+			auto it = std::stable_partition(requesters.begin(), requesters.end(), [&](const RenderRequester& r) { return r.id != id; });
+			for (auto r = it; r != requesters.end(); ++r)
+				cancelled.push_back(std::make_pair(params->modelName, *r));
+			requesters.erase(it, requesters.end());
+			return requesters.empty();
+		};
+
+		// a job shared by several requests goes on until all of them are cancelled
+		for (auto it = m_queue.begin(); it != m_queue.end();)
+		{
+			if (removeRequesters(*it))
+			{
+				removed.push_back(*it);
+				m_pending.erase((*it)->key);
+				it = m_queue.erase(it);
+			}
+			else
+				++it;
+		}
+		// jobs in flight stop at the next frame boundary
+		for (auto params : m_running)
+		{
+			if (!params->requesters.empty() && removeRequesters(params))
+				params->cancelled = true;
+		}
+		// open sessions skip their queued chunks, the session thread drops them after the chunk it may be building
+		for (auto& session : m_sessions)
+		{
+			RenderParams* params = session.second;
+			if (!params->requesters.empty() && params->requesters.front().id == id)
+				params->cancelled = true;
+		}
+	}
+	// sessions whose opening message is still queued are cancelled by the session thread in message order
+	if (m_pSessionThread != nullptr)
+	{
+		SessionMessage* message = new SessionMessage("", NPLInterface::NPLObjectProxy(), nullptr);
+		message->cancelId = id;
+		PostSessionMessage(message);
+	}
+
+	for (auto& requester : cancelled)
+		requester.second.callBack(requester.first, requester.second.callName, "cancelled");
+	for (auto params : removed)
+		delete params;
+}
+
+void NplOSRender::PostSessionMessage(SessionMessage* message)
+{
+	if (m_pSessionThread == nullptr)
+		m_pSessionThread = new std::thread(&NplOSRender::SessionTask, this);
+	m_sessionInbox.Push(message);
+}
+
+void NplOSRender::SessionTask()
+{
+	while (true)
+	{
+		// wake up for the next message, or when the first open session expires
+		auto until = std::chrono::steady_clock::time_point::max();
+		for (auto& session : m_sessions)
+			until = std::min(until, session.second->sessionExpires);
+		SessionMessage* message = nullptr;
+		if (m_sessionInbox.Pop(message, until))
+		{
+			UpdateSession(*message);
+			delete message;
+		}
+		else if (m_sessionInbox.IsClosed())
+			break;
+
+		auto now = std::chrono::steady_clock::now();
+		for (auto it = m_sessions.begin(); it != m_sessions.end();)
+		{
+			auto session = it++;
+			if (session->second->cancelled)
+				DropSession(session->first, "cancelled");
+			else if (now > session->second->sessionExpires)
+				DropSession(session->first, "expired");
+		}
+	}
+}
+
+void NplOSRender::DropSession(const string& sessionId, const string& error)
+{
+	RenderParams* params = nullptr;
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
+		auto session = m_sessions.find(sessionId);
+		if (session == m_sessions.end())
+			return;
+		params = session->second;
+		m_sessions.erase(session);
+	}
+	NotifyRequesters(params->modelName, params->requesters, error);
+	ReleaseMesh(params->mesh);
+	params->mesh = nullptr;
+	delete params;
+}
+
+void NplOSRender::UpdateSession(SessionMessage& message)
+{
+	if (!message.cancelId.empty())
+	{
+		for (auto& session : m_sessions)
+		{
+			RenderParams* params = session.second;
+			if (!params->requesters.empty() && params->requesters.front().id == message.cancelId)
+				params->cancelled = true;
+		}
+		return;
+	}
+	NPLInterface::NPLObjectProxy& tabMsg = message.tabMsg;
+	if (message.params != nullptr)
+	{
+		// reopening a session drops what was streamed so far
+		DropSession(message.sessionId, "cancelled");
+		message.params->mesh = AcquireMesh();
+		std::unique_lock<std::mutex> lk(m_mutex);
+		m_sessions[message.sessionId] = message.params;
+		message.params = nullptr;
+	}
+	auto session = m_sessions.find(message.sessionId);
+	if (session == m_sessions.end())
+		return;
+	RenderParams* params = session->second;
+	if ((bool)tabMsg["abort"] || params->cancelled)
+	{
+		DropSession(message.sessionId, "cancelled");
+		return;
+	}
+	params->sessionExpires = std::chrono::steady_clock::now() + SessionTimeout;
+	bool commit = (bool)tabMsg["commit"];
+
+	// each chunk is built into the job's mesh right away, so that only the chunks waiting here are held as tables
+	NPLInterface::NPLObjectProxy& meshes = tabMsg["meshes"];
+	if (meshes.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_Table)
+	{
+		HashNPLObject(meshes, params->contentHash);
+		AppendMeshes(*params, meshes, *params->mesh);
+	}
+	NPLInterface::NPLObjectProxy& renderList = tabMsg["render"];
+	if (renderList.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_Table)
+	{
+		HashNPLObject(renderList, params->contentHash);
+		AppendShapes(*params, renderList, *params->mesh);
+	}
+	tabMsg.MakeNil();
+
+	// the geometry of open sessions is held outside the jobs in flight, so it has a limit of its own
+	size_t limit = DefaultSessionBytes;
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
+		if (m_nMemoryBudget > 0)
+			limit = m_nMemoryBudget;
+	}
+	size_t bytes = 0;
+	for (auto& open : m_sessions)
+		bytes += open.second->mesh->GetCapacityBytes();
+	if (bytes > limit)
+	{
+		DropSession(message.sessionId, "too_large");
+		return;
+	}
+
+	if (commit)
+	{
+		{
+			std::unique_lock<std::mutex> lk(m_mutex);
+			m_sessions.erase(message.sessionId);
+		}
+		FinishMesh(*params, *params->mesh);
+		QueueTask(params);
+	}
+}
+
+void NplOSRender::BuildTask()
+{
+	// expired jobs are answered wherever they are queued, not when they reach the head of the queue
+	std::vector<RenderParams*> expired;
+	auto answerExpired = [&]() {
+		for (auto job : expired)
+		{
+			NotifyRequesters(job->modelName, job->requesters, "expired");
+			ReleaseMesh(job->mesh);
+			job->mesh = nullptr;
+			delete job;
+		}
+		expired.clear();
+	};
+	// sleeps until notified or until the next queued job expires
+	auto waitForChange = [this](std::unique_lock<std::mutex>& lk, std::chrono::steady_clock::time_point nextDeadline) {
+		if (nextDeadline == std::chrono::steady_clock::time_point::max())
+			m_condition.wait(lk);
+		else
+			m_condition.wait_until(lk, nextDeadline);
+	};
+	while (true)
+	{
+		RenderParams* params = nullptr;
+		{
+			std::unique_lock<std::mutex> lk(m_mutex);
+			while (m_start)
+			{
+				std::chrono::steady_clock::time_point nextDeadline = ExpireQueuedTasks(expired);
+				if (!expired.empty() || CanStartTask())
+					break;
+				waitForChange(lk, nextDeadline);
+			}
+
+			if (!m_start)
+				break;
+
+			if (expired.empty())
+			{
+				params = *m_queue.begin();
+				m_queue.erase(m_queue.begin());
+				m_running.push_back(params);
+				m_nMemoryInUse += params->memoryCost;
+			}
+		}
+		answerExpired();
+		if (params == nullptr)
+			continue;
+
+		if (std::chrono::steady_clock::now() > params->deadline)
+			params->error = "expired";
+		// streamed jobs arrive with their mesh already built
+		else if (!params->cancelled && params->mesh == nullptr)
+		{
+			params->mesh = AcquireMesh();
+			BuildMesh(*params, *params->mesh);
+		}
+		params->renderList.MakeNil();
+		params->meshes.MakeNil();
+
+		if (!params->error.empty() || params->cancelled)
+		{
+			if (!m_writeQueue.Push(params))
+				delete params;
+			continue;
+		}
+
+		std::unique_lock<std::mutex> lk(m_mutex);
+		while (m_start && !m_workers.empty() && m_rasterQueue.size() >= m_workers.size())
+		{
+			// the queue keeps expiring while every worker is busy
+			std::chrono::steady_clock::time_point nextDeadline = ExpireQueuedTasks(expired);
+			if (!expired.empty())
+			{
+				lk.unlock();
+				answerExpired();
+				lk.lock();
+				continue;
+			}
+			waitForChange(lk, nextDeadline);
+		}
+		if (!m_start)
+		{
 			delete params;
+			break;
 		}
+		if (m_workers.empty())
+		{
+			// no context could be created, fail this job and those left for workers of an earlier pool
+			std::deque<RenderParams*> failed;
+			failed.swap(m_rasterQueue);
+			failed.push_back(params);
+			lk.unlock();
+			for (auto job : failed)
+			{
+				job->error = "no_context";
+				if (!m_writeQueue.Push(job))
+					delete job;
+			}
+			continue;
+		}
+		m_rasterQueue.push_back(params);
+		m_condition.notify_all();
+	}
+	for (auto job : expired)
+		delete job;
+}
+
+/**
+* makes the cell of a frame in the sprite sheet the color buffer, with the sheet's row stride, or the scratch frame of
+* a supersampled job. The views are flipped, so the bottom row of the color buffer is the top row of the PNG
+*/
+static void BindFrame(OSMesaContext context, RenderParams* params, GLubyte* scratch, int frame)
+{
+	int width = params->GetRenderWidth();
+	if (scratch != nullptr)
+		OSMesaMakeCurrent(context, scratch, GL_UNSIGNED_BYTE, width, params->GetRenderHeight());
+	else
+		OSMesaMakeCurrent(context, params->bigBuffer + (size_t)width * 4 * frame, GL_UNSIGNED_BYTE, width, params->GetRenderHeight());
+	OSMesaPixelStore(OSMESA_ROW_LENGTH, scratch != nullptr ? width : width * params->frame);
+	OSMesaPixelStore(OSMESA_Y_UP, 1);
+}
+
+/**
+* averages each aa x aa block of a supersampled frame into one pixel of the frame's cell. The sheet stays premultiplied
+* until the smaller sheets have been filtered from it
+*/
+static void ResolveFrame(RenderParams* params, const GLubyte* scratch, int frame)
+{
+	DownsampleFrame(scratch, params->GetRenderWidth() * 4, params->GetRenderWidth(), params->GetRenderHeight(),
+		params->bigBuffer + (size_t)params->width * 4 * frame, (size_t)params->width * 4 * params->frame, params->width, params->height, false);
+}
+
+/** makes a context of the worker current on the worker's own surface, frames are then drawn into its render target */
+static void BindWorker(RenderWorker& worker, OSMesaContext context)
+{
+	OSMesaMakeCurrent(context, &worker.surface[0], GL_UNSIGNED_BYTE, 1, (GLsizei)(worker.surface.size() / 4));
+}
+
+void NplOSRender::DoTask(RenderWorker* worker)
+{
+	int warmup = 0;
+	while (true)
+	{
+		RenderParams* params = nullptr;
+		bool helping = false;
+		{
+			std::unique_lock<std::mutex> lk(m_mutex);
+			// only jobs of its own pool can be helped, the others use buffers of another share group
+			auto findFrameJob = [&]() -> RenderParams* {
+				for (auto job : m_frameJobs)
+				{
+					if (job->pool == worker->pool && job->nextFrame < job->frame)
+						return job;
+				}
+				return nullptr;
+			};
+			worker->idle = true;
+			while (m_start && worker->pool == m_nPool && findFrameJob() == nullptr && m_rasterQueue.empty() && warmup == m_nWarmup)
+				m_condition.wait(lk);
+			worker->idle = false;
+
+			if (!m_start || worker->pool != m_nPool)
+				break;
+
+			if (warmup != m_nWarmup)
+			{
+				warmup = m_nWarmup;
+				lk.unlock();
+				WarmupTask(*worker);
+				continue;
+			}
+
+			// help the jobs already in progress before starting a new one
+			params = findFrameJob();
+			if (params != nullptr)
+			{
+				params->helpers++;
+				helping = true;
+			}
+			else if (!m_rasterQueue.empty())
+			{
+				params = m_rasterQueue.front();
+				m_rasterQueue.pop_front();
+				m_condition.notify_all();
+			}
+		}
+
+		if (nullptr == params) continue;
+
+		if (params->mlaa && !worker->filterTried)
+		{
+			worker->filtered = CreateFilteredContext(*worker);
+			worker->filterTried = true;
+		}
+		if (helping)
+		{
+			HelpRenderTask(params, *worker);
+			std::unique_lock<std::mutex> lk(m_mutex);
+			params->helpers--;
+			m_frameDone.notify_all();
+			continue;
+		}
+
+		if (!params->cancelled)
+			RenderTask(params, *worker);
+		if (!m_encodeQueue.Push(params))
+			delete params;
+	}
+	BindWorker(*worker, worker->context);
+	worker->program.Destroy();
+	worker->target.Destroy();
+	OSMesaMakeCurrent(nullptr, nullptr, 0, 0, 0);
+	if (worker->filtered != nullptr)
+		OSMesaDestroyContext(worker->filtered);
+	OSMesaDestroyContext(worker->context);
+	worker->filtered = worker->context = nullptr;
+
+	std::unique_lock<std::mutex> lk(m_mutex);
+	worker->finished = true;
+}
+
+void NplOSRender::WarmupTask(RenderWorker& worker)
+{
+	// a tiny octahedron through the normal render path, so that driver setup and shader compilation happen before the first job
+	RenderParams params("", NPLInterface::NPLObjectProxy());
+	params.width = params.height = 16;
+	params.frame = 1;
+	params.mesh = AcquireMesh();
+	MeshData& mesh = *params.mesh;
+	const float axes[6][3] = { { 1, 0, 0 }, { -1, 0, 0 }, { 0, 1, 0 }, { 0, -1, 0 }, { 0, 0, 1 }, { 0, 0, -1 } };
+	for (int i = 0; i < 6; i++)
+	{
+		mesh.vertexBuffer.push_back(Vector3(axes[i][0], axes[i][1], axes[i][2]));
+		mesh.normalBuffer.push_back(Vector3(axes[i][0], axes[i][1], axes[i][2]));
+		mesh.colorBuffer.push_back(Vector3(1.0f, 1.0f, 1.0f));
+	}
+	const unsigned int faces[8][3] = { { 0, 2, 4 }, { 2, 1, 4 }, { 1, 3, 4 }, { 3, 0, 4 }, { 2, 0, 5 }, { 1, 2, 5 }, { 3, 1, 5 }, { 0, 3, 5 } };
+	for (int i = 0; i < 8; i++)
+		mesh.indexBuffer.insert(mesh.indexBuffer.end(), faces[i], faces[i] + 3);
+	mesh.shapes.push_back((int)mesh.indexBuffer.size());
+	mesh.center = Vector3(0, 0, 0);
+	mesh.extents = Vector3(2, 2, 2);
+
+	RenderTask(&params, worker);
+	if (params.error.empty())
+		EncodePng(params.bigBuffer, params.width * params.frame, params.height, params.pngData);
+	m_sheetPool.Release(params.bigBuffer, params.GetSheetSize());
+	params.bigBuffer = nullptr;
+}
+
+void NplOSRender::Warmup()
+{
+	std::unique_lock<std::mutex> lk(m_mutex);
+	if (!m_start)
+		StartWorkers();
+	m_nWarmup++;
+	m_condition.notify_all();
+}
+
+void NplOSRender::EncodeTask()
+{
+	RenderParams* params = nullptr;
+	while (m_encodeQueue.Pop(params))
+	{
+		if (!params->cancelled && params->error.empty() && params->bigBuffer != nullptr)
+		{
+			// the smaller sheets are filtered from the premultiplied sheet first
+			for (auto& output : params->outputs)
+			{
+				size_t size = (size_t)output.width * output.height * 4 * params->frame;
+				unsigned char* sheet = m_sheetPool.Acquire(size);
+				DownsampleSheet(params->bigBuffer, params->width, params->height, sheet, output.width, output.height, params->frame, true);
+				if (!EncodePng(sheet, output.width * params->frame, output.height, output.pngData))
+					params->error = "encode_failed";
+				m_sheetPool.Release(sheet, size);
+			}
+			// supersampled and MLAA edges are blended with the transparent background, straight alpha keeps them from darkening
+			if (params->aa > 1 || params->mlaa)
+				UnpremultiplyPixels(params->bigBuffer, params->GetSheetSize() / 4);
+			if (!EncodePng(params->bigBuffer, params->width * params->frame, params->height, params->pngData))
+				params->error = "encode_failed";
+		}
+		m_sheetPool.Release(params->bigBuffer, params->GetSheetSize());
+		params->bigBuffer = nullptr;
+
+		if (!m_writeQueue.Push(params))
+			delete params;
+	}
+}
+
+void NplOSRender::WriteTask()
+{
+	RenderParams* params = nullptr;
+	while (m_writeQueue.Pop(params))
+	{
+		if (params->error.empty() && params->cancelled)
+			params->error = "cancelled";
+		auto writeFile = [params](const string& fileName, const std::vector<unsigned char>& pngData) {
+			if (!params->error.empty())
+				return;
+			FILE *fp = fopen(fileName.c_str(), "wb");
+			if (fp != nullptr)
+			{
+				if (!pngData.empty())
+					fwrite(&pngData[0], 1, pngData.size(), fp);
+				fclose(fp);
+			}
+			else
+				params->error = "write_failed";
+		};
+		writeFile(params->modelName, params->pngData);
+		for (auto& output : params->outputs)
+			writeFile(output.fileName, output.pngData);
+		params->pngData.clear();
+		for (auto& output : params->outputs)
+			output.pngData.clear();
+
+		std::vector<RenderRequester> requesters;
+		{
+			std::unique_lock<std::mutex> lk(m_mutex);
+			m_running.erase(std::find(m_running.begin(), m_running.end(), params));
+			auto pending = m_pending.find(params->key);
+			if (pending != m_pending.end() && pending->second == params)
+				m_pending.erase(pending);
+			requesters.swap(params->requesters);
+			m_nMemoryInUse -= params->memoryCost;
+			m_condition.notify_all();
+		}
+		// one callback per file, the smaller sheets first
+		if (params->error.empty())
+		{
+			for (auto& output : params->outputs)
+				NotifyRequesters(output.fileName, requesters, params->error);
+		}
+		NotifyRequesters(params->modelName, requesters, params->error);
+		delete params;
 		params = nullptr;
-		
-		delete m_pThread;
-		m_pThread = nullptr;
 	}
+}
+
+void NplOSRender::RenderTask(RenderParams* params, RenderWorker& worker)
+{
+	OSMesaContext context = params->mlaa && worker.filtered ? worker.filtered : worker.context;
+	ShaderProgram& program = worker.program;
+	params->pool = worker.pool;
+	params->bigBuffer = m_sheetPool.Acquire(params->GetSheetSize());
+	// supersampled frames are read back one at a time and filtered into their cells
+	GLubyte* scratch = params->aa > 1 ? m_sheetPool.Acquire(params->GetRenderFrameSize()) : nullptr;
+	// MLAA runs when the filtered context's own color buffer is read back, other jobs draw into the worker's render target.
+	// That color buffer is OSMesa's, shared by all contexts made current on the same size, so MLAA jobs render one at a time
+	bool filtered = context == worker.filtered;
+	std::unique_lock<std::mutex> filterLock(m_filterMutex, std::defer_lock);
+	if (filtered)
+	{
+		filterLock.lock();
+		BindFrame(context, params, scratch, 0);
+	}
+	else
+		BindWorker(worker, context);
+	if (worker.shaders && !program.IsValid() && !program.Create())
+	{
+		params->error = "render_failed";
+		if (scratch != nullptr)
+			m_sheetPool.Release(scratch, params->GetRenderFrameSize());
+		return;
+	}
+	InitGL(worker.shaders);
+
+	MeshData& mesh = *params->mesh;
+	if (worker.shaders)
+		params->buffers.Upload(mesh);
+	else
+	{
+		params->listId = CreateDisplayList(mesh);
+		params->listCount = 1 + (GLsizei)mesh.instancedMeshes.size();
+	}
+	params->center = mesh.center;
+	params->scale = std::max(std::max(mesh.extents.x, mesh.extents.y), mesh.extents.z);
+	ReleaseMesh(params->mesh);
+	params->mesh = nullptr;
+	ResizeView(params->GetRenderWidth(), params->GetRenderHeight(), params->scale, worker.shaders);
+
+	// a retired pool takes no new jobs, so its idle workers have left and cannot help
+	size_t workerCount = 1;
+	size_t idleCount = 0;
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
+		if (worker.pool == m_nPool)
+		{
+			workerCount = m_workers.size();
+			for (auto other : m_workers)
+			{
+				if (other->idle)
+					idleCount++;
+			}
+			// idle workers take the jobs waiting for a worker first
+			idleCount -= std::min(idleCount, m_rasterQueue.size());
+		}
+	}
+
+	// single pass jobs on the shader path draw all frames with one call when the whole sheet fits in a viewport and a
+	// render target, unless idle workers could share their frames
+	bool singlePass = false;
+	if (params->singlePass && worker.shaders && params->frame > 1 && !filtered && idleCount == 0)
+	{
+		GLint maxViewport[2] = { 0, 0 };
+		GLint maxWidth = 0;
+		glGetIntegerv(GL_MAX_VIEWPORT_DIMS, maxViewport);
+		glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &maxWidth);
+		singlePass = params->GetRenderWidth() * params->frame <= std::min(maxViewport[0], maxWidth);
+	}
+	if (singlePass)
+	{
+		if (!RenderSheet(params, worker, scratch))
+			params->error = "render_failed";
+	}
+	else
+	{
+		if (params->frame > 1 && workerCount > 1 && !filtered)
+		{
+			// buffers must be complete before another context of the share group reads them
+			if (worker.shaders)
+				glFinish();
+			// let idle workers pick up the remaining frames of this job
+			std::unique_lock<std::mutex> lk(m_mutex);
+			m_frameJobs.push_back(params);
+			m_condition.notify_all();
+		}
+		if (!RenderFrames(params, worker, context, scratch))
+			params->error = "render_failed";
+		{
+			std::unique_lock<std::mutex> lk(m_mutex);
+			auto it = std::find(m_frameJobs.begin(), m_frameJobs.end(), params);
+			if (it != m_frameJobs.end())
+				m_frameJobs.erase(it);
+			while (params->helpers > 0)
+				m_frameDone.wait(lk);
+		}
+	}
+
+	if (worker.shaders)
+		params->buffers.Release();
+	else
+		glDeleteLists(params->listId, params->listCount);
+	if (scratch != nullptr)
+		m_sheetPool.Release(scratch, params->GetRenderFrameSize());
+}
+
+void NplOSRender::HelpRenderTask(RenderParams* params, RenderWorker& worker)
+{
+	// MLAA jobs are not split, helpers always draw into their render target
+	OSMesaContext context = worker.context;
+	BindWorker(worker, context);
+	if (worker.shaders && !worker.program.IsValid() && !worker.program.Create())
+		return;
+	InitGL(worker.shaders);
+	ResizeView(params->GetRenderWidth(), params->GetRenderHeight(), params->scale, worker.shaders);
+	GLubyte* scratch = params->aa > 1 ? m_sheetPool.Acquire(params->GetRenderFrameSize()) : nullptr;
+	RenderFrames(params, worker, context, scratch);
+	if (scratch != nullptr)
+		m_sheetPool.Release(scratch, params->GetRenderFrameSize());
+}
 
-	if (m_context != nullptr)
+MeshData* NplOSRender::AcquireMesh()
+{
 	{
-		OSMesaDestroyContext(m_context);
-		m_context = nullptr;
+		std::unique_lock<std::mutex> lk(m_mutex);
+		if (!m_meshPool.empty())
+		{
+			MeshData* mesh = m_meshPool.back();
+			m_meshPool.pop_back();
+			return mesh;
+		}
 	}
+	return new MeshData();
 }
 
-void NplOSRender::PostTask(const char* msg, int length, std::function<void(const string&, const string&)> cb)
+void NplOSRender::ReleaseMesh(MeshData* mesh)
 {
-	NPLInterface::NPLObjectProxy tabMsg = NPLInterface::NPLHelper::MsgStringToNPLTable(msg, length);
-	if (nullptr == m_pThread)
+	if (mesh == nullptr)
+		return;
+	mesh->Clear();
+	// very large meshes give their memory back instead of pinning it for every later job
+	if (mesh->GetCapacityBytes() <= 64 * 1024 * 1024)
 	{
-		m_start = true;
-		m_pThread = new std::thread(&NplOSRender::DoTask, this);
+		std::unique_lock<std::mutex> lk(m_mutex);
+		if (m_meshPool.size() < 4)
+		{
+			m_meshPool.push_back(mesh);
+			return;
+		}
 	}
+	delete mesh;
+}
 
-	string fileName = tabMsg["model"];
-	size_t pos = fileName.find_last_of('.');
-	if (pos != string::npos)
-		fileName = fileName.substr(0, pos);
-	fileName.append(".png");
-	RenderParams* params = new RenderParams(fileName, tabMsg["render"], cb);
-	params->callName = tabMsg["callback"];
-	double w = tabMsg["width"];
-	double h = tabMsg["height"];
-	double f = tabMsg["frame"];
-	if (w > 0) params->width = (int)w;
-	if (h > 0) params->height = (int)h;
-	if (f > 0) params->frame = (int)f;
 
-	std::unique_lock<std::mutex> lk(m_mutex);
-	m_queue.push(params);
-	m_condition.notify_one();
-}
 
-void NplOSRender::DoTask()
+bool NplOSRender::RenderFrames(RenderParams* params, RenderWorker& worker, OSMesaContext context, GLubyte* scratch)
 {
-	while (m_start)
+	int width = params->GetRenderWidth();
+	int height = params->GetRenderHeight();
+	bool filtered = context == worker.filtered;
+	if (!filtered && !worker.target.Bind(width, height))
+		return false;
+	ShaderProgram& program = worker.program;
+	float degree = 360.0f / params->frame;
+	std::vector<GLuint> vertexArrays;
+	if (worker.shaders)
 	{
-		RenderParams* params = nullptr;
-		{
-			std::unique_lock<std::mutex> lk(m_mutex);
-			while (m_queue.empty())
-				m_condition.wait(lk);
-
-			if (m_queue.empty())
-				continue;
+		program.Use();
+		program.SetProjection(width, height, params->scale);
+		program.SetTurntable(-60.0f, -degree, params->center);
+		params->buffers.CreateVertexArrays(vertexArrays, 1);
+	}
+	for (int i = params->nextFrame++; i < params->frame && !params->cancelled; i = params->nextFrame++)
+	{
+		if (filtered)
+			BindFrame(context, params, scratch, i);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
 
-			params = m_queue.front();
-			m_queue.pop();
+		if (worker.shaders)
+		{
+			program.SetFrames(i, 1);
+			params->buffers.Draw(vertexArrays, 1);
 		}
-		
-		if (nullptr == params) continue;
-
-		GLubyte* buffer = new GLubyte[params->width * params->height * 4];
-		if (buffer != nullptr)
-			OSMesaMakeCurrent(m_context, buffer, GL_UNSIGNED_BYTE, params->width, params->height);
-		InitGL();
-
-		Vector3 center, extents;
-		GLuint listId = CreateDisplayList(params->renderList, center, extents);
-		GLfloat scale = std::max(std::max(extents.x, extents.y), extents.z);
-		ResizeView(params->width, params->height, scale);
-
-		int fourWidth = params->width * 4;
-		GLubyte* bigBuffer = new GLubyte[fourWidth * params->height * params->frame];
-		float degree = 360.0f / params->frame;
-		for (int i = 0; i < params->frame; i++)
+		else
 		{
-			glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
-
 			glPushMatrix();
 			glRotatef(-60.0f, 1, 0, 0);
 			glRotatef(-degree * i, 0, 0, 1);
-			glTranslatef(-center.x, -center.y, -center.z);
-			glCallList(listId);
+			glTranslatef(-params->center.x, -params->center.y, -params->center.z);
+			glCallList(params->listId);
 			glPopMatrix();
-			glFinish();
-			for (int j = 0; j < params->height; j++)
-			{
-				memcpy(bigBuffer + j * fourWidth * params->frame + fourWidth * i, buffer + j * fourWidth, fourWidth * sizeof(GLubyte));
-			}
 		}
-		WritePng(params->modelName, bigBuffer, params->width * params->frame, params->height);
+		// the frame's cell of the sheet, with the sheet's row stride
+		if (filtered)
+			glFinish();
+		else if (scratch != nullptr)
+			worker.target.Read(0, width, height, scratch, width);
+		else
+			worker.target.Read(0, width, height, params->bigBuffer + (size_t)width * 4 * i, width * params->frame);
+		if (scratch != nullptr)
+			ResolveFrame(params, scratch, i);
+	}
+	params->buffers.DeleteVertexArrays(vertexArrays);
+	return true;
+}
 
-		glDeleteLists(listId, 1);
-		delete[] buffer;
-		buffer = nullptr;
-		delete[] bigBuffer;
-		bigBuffer = nullptr;
+/**
+* renders every frame in one pass: the render target holds the whole sheet, and each instance is drawn once per frame
+* into that frame's cell. Vertex fetch and the per-draw overhead are paid once per job instead of once per frame.
+* A cancelled job can only stop before the draw.
+*/
+bool NplOSRender::RenderSheet(RenderParams* params, RenderWorker& worker, GLubyte* scratch)
+{
+	ShaderProgram& program = worker.program;
+	int sheetWidth = params->GetRenderWidth() * params->frame;
+	if (!worker.target.Bind(sheetWidth, params->GetRenderHeight()))
+		return false;
+	if (params->cancelled)
+		return true;
+	glViewport(0, 0, sheetWidth, params->GetRenderHeight());
 
-		params->callBack(params->modelName, params->callName);
-		delete params;
-		params = nullptr;
+	std::vector<GLuint> vertexArrays;
+	params->buffers.CreateVertexArrays(vertexArrays, params->frame);
+	program.Use();
+	program.SetProjection(params->GetRenderWidth(), params->GetRenderHeight(), params->scale);
+	program.SetTurntable(-60.0f, -360.0f / params->frame, params->center);
+	program.SetFrames(0, params->frame);
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+	params->buffers.Draw(vertexArrays, params->frame);
+	if (scratch == nullptr)
+		worker.target.Read(0, sheetWidth, params->GetRenderHeight(), params->bigBuffer, sheetWidth);
+	for (int i = 0; scratch != nullptr && i < params->frame; i++)
+	{
+		worker.target.Read(params->GetRenderWidth() * i, params->GetRenderWidth(), params->GetRenderHeight(), scratch, params->GetRenderWidth());
+		ResolveFrame(params, scratch, i);
 	}
+	params->buffers.DeleteVertexArrays(vertexArrays);
+	params->nextFrame = params->frame;
+	return true;
 }
 
-void NplOSRender::InitGL()
+void NplOSRender::InitGL(bool shaders)
 {
-	glShadeModel(GL_SMOOTH);                    // shading mathod: GL_SMOOTH or GL_FLAT
 	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);      // 4-byte pixel alignment
 
 												// enable /disable features
-	glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
 	glEnable(GL_DEPTH_TEST);
-	glEnable(GL_LIGHTING);
 	glEnable(GL_CULL_FACE);
-
-	glEnable(GL_LINE_SMOOTH);
+	// the views are flipped vertically, which turns counterclockwise front faces clockwise
+	glFrontFace(GL_CW);
 	glEnable(GL_BLEND);
 	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-	glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
-
-	// track material ambient and diffuse from surface color, call it before glEnable(GL_COLOR_MATERIAL)
-	glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
-	glEnable(GL_COLOR_MATERIAL);
 
 	glClearColor(0.0, 0.0, 0.0, 0.0);
 	glClearStencil(0);
 	glClearDepth(1.0f);
 	glDepthFunc(GL_LEQUAL);
 
+	// the program does its own lighting and clips each frame to its tile of the viewport, the rest is
+	// fixed-function state which core profile contexts do not have
+	if (shaders)
+	{
+		glEnable(GL_CLIP_DISTANCE0);
+		glEnable(GL_CLIP_DISTANCE1);
+		return;
+	}
+
+	glShadeModel(GL_SMOOTH);                    // shading mathod: GL_SMOOTH or GL_FLAT
+	glHint(GL_PERSPECTIVE_CORRECTION_HINT, GL_NICEST);
+	glEnable(GL_LIGHTING);
+
+	glEnable(GL_LINE_SMOOTH);
+	glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
+
+	// track material ambient and diffuse from surface color, call it before glEnable(GL_COLOR_MATERIAL)
+	glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
+	glEnable(GL_COLOR_MATERIAL);
+
 	InitLights();
 }
 
@@ -196,11 +1495,16 @@ void NplOSRender::InitLights()
 	glEnable(GL_LIGHT0);                        // MUST enable each light source after configuration
 }
 
-void NplOSRender::ResizeView(int w, int h, float scale)
+void NplOSRender::ResizeView(int w, int h, float scale, bool shaders)
 {
 	glViewport(0, 0, (GLsizei)w, (GLsizei)h);
+	// the shader path sets the same projection on its program
+	if (shaders)
+		return;
 	glMatrixMode(GL_PROJECTION);
 	glLoadIdentity();
+	// flipped vertically, so that the first row in memory is the top of the frame
+	glScalef(1.0f, -1.0f, 1.0f);
 	if (w <= h)
 		glOrtho(-scale, scale, -scale*(GLfloat)h / (GLfloat)w, scale*(GLfloat)h / (GLfloat)w, -scale, scale);
 	else
@@ -208,18 +1512,427 @@ void NplOSRender::ResizeView(int w, int h, float scale)
 	glMatrixMode(GL_MODELVIEW);
 }
 
-GLuint NplOSRender::CreateDisplayList(NPLInterface::NPLObjectProxy& renderList, Vector3& center, Vector3& extents)
+/** reads the 16 numbers of a world_matrix table, identity if it is missing */
+static Matrix4 GetWorldMatrix(NPLInterface::NPLObjectProxy& matrix)
+{
+	Matrix4 m(1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1);
+	if (matrix.GetType() != NPLInterface::NPLObjectBase::NPLObjectType_Table)
+		return m;
+	int i = 0;
+	for (NPLInterface::NPLTable::IndexIterator_Type mCur = matrix.index_begin(), mEnd = matrix.index_end(); mCur != mEnd && i < 16; ++mCur)
+	{
+		m._m[i] = (float)(double)mCur->second;
+		i++;
+	}
+	return m;
+}
+
+/** appends packed Vector3 data given as a binary string of little-endian float32 triples */
+static size_t AppendPackedVectors(NPLInterface::NPLObjectProxy& value, std::vector<Vector3>& buffer)
+{
+	if (value.GetType() != NPLInterface::NPLObjectBase::NPLObjectType_String)
+		return 0;
+	const string& data = value;
+	size_t count = data.size() / sizeof(Vector3);
+	size_t first = buffer.size();
+	buffer.resize(first + count);
+	if (count > 0)
+		memcpy(&buffer[first], data.c_str(), count * sizeof(Vector3));
+	return count;
+}
+
+/**
+* appends a shape whose vertices, normals and colors are binary strings of little-endian float32 xyz triples,
+* and whose indices are a binary string of zero based little-endian uint32. Returns the number of indices appended.
+*/
+static int AppendPackedShape(NPLInterface::NPLObjectProxy& value, MeshData& mesh, Vector3& vmin, Vector3& vmax)
+{
+	static_assert(sizeof(Vector3) == 3 * sizeof(float), "Vector3 must be three packed floats");
+	size_t firstVertex = mesh.vertexBuffer.size();
+	size_t vertexCount = AppendPackedVectors(value["vertices"], mesh.vertexBuffer);
+
+	Matrix4 m = GetWorldMatrix(value["world_matrix"]);
+	if (vertexCount > 0)
+		TransformPoints(&mesh.vertexBuffer[firstVertex], &mesh.vertexBuffer[firstVertex], vertexCount, m, vmin, vmax);
+
+	// missing or short normal and color arrays are padded, so that every vertex can be drawn
+	mesh.normalBuffer.resize(firstVertex, Vector3(0, 0, 1));
+	AppendPackedVectors(value["normals"], mesh.normalBuffer);
+	mesh.normalBuffer.resize(firstVertex + vertexCount, Vector3(0, 0, 1));
+	if (vertexCount > 0)
+		TransformNormals(&mesh.normalBuffer[firstVertex], vertexCount, m);
+	mesh.colorBuffer.resize(firstVertex, Vector3(1, 1, 1));
+	AppendPackedVectors(value["colors"], mesh.colorBuffer);
+	mesh.colorBuffer.resize(firstVertex + vertexCount, Vector3(1, 1, 1));
+
+	NPLInterface::NPLObjectProxy& indices = value["indices"];
+	if (indices.GetType() != NPLInterface::NPLObjectBase::NPLObjectType_String)
+		return 0;
+	const string& data = indices;
+	size_t indexCount = data.size() / sizeof(unsigned int);
+	size_t firstIndex = mesh.indexBuffer.size();
+	mesh.indexBuffer.resize(firstIndex + indexCount);
+	if (indexCount > 0)
+		memcpy(&mesh.indexBuffer[firstIndex], data.c_str(), indexCount * sizeof(unsigned int));
+	for (size_t i = firstIndex; i < mesh.indexBuffer.size(); i++)
+	{
+		if (mesh.indexBuffer[i] >= vertexCount)
+		{
+			printf("packed shape index %u out of range\n", mesh.indexBuffer[i]);
+			mesh.indexBuffer.resize(firstIndex);
+			return 0;
+		}
+		mesh.indexBuffer[i] += (unsigned int)firstVertex;
+	}
+	return (int)indexCount;
+}
+
+/**
+* maps a binary mesh_file (see MeshFileHeader) and adds it as a shape drawn straight from the mapping.
+* files used by several shapes of a render list are mapped once.
+*/
+static bool AppendMappedShape(NPLInterface::NPLObjectProxy& value, MeshData& mesh, std::map<string, std::shared_ptr<MappedFile> >& files, Vector3& vmin, Vector3& vmax)
+{
+	const string& fileName = value["mesh_file"];
+	std::shared_ptr<MappedFile>& file = files[fileName];
+	if (!file)
+	{
+		file = std::make_shared<MappedFile>();
+		if (!file->Open(fileName))
+		{
+			printf("can not map mesh file %s\n", fileName.c_str());
+			file.reset();
+			return false;
+		}
+	}
+
+	const unsigned char* data = file->GetData();
+	size_t size = file->GetSize();
+	if (size < sizeof(MeshFileHeader))
+	{
+		printf("mesh file %s is too small\n", fileName.c_str());
+		return false;
+	}
+	const MeshFileHeader& header = *(const MeshFileHeader*)data;
+	if (memcmp(header.magic, "NPLM", 4) != 0 || header.version != 1)
+	{
+		printf("mesh file %s has an unknown format\n", fileName.c_str());
+		return false;
+	}
+	size_t vectorSize = (size_t)header.vertexCount * 3 * sizeof(float);
+	size_t offset = sizeof(MeshFileHeader);
+	size_t expected = offset + vectorSize + (size_t)header.indexCount * sizeof(unsigned int);
+	if (header.flags & MeshFileHeader::HasNormals) expected += vectorSize;
+	if (header.flags & MeshFileHeader::HasColors) expected += vectorSize;
+	if (size < expected)
+	{
+		printf("mesh file %s is truncated\n", fileName.c_str());
+		return false;
+	}
+
+	MappedShape shape;
+	shape.file = file;
+	shape.vertexCount = header.vertexCount;
+	shape.indexCount = header.indexCount;
+	shape.vertices = (const float*)(data + offset);
+	offset += vectorSize;
+	if (header.flags & MeshFileHeader::HasNormals)
+	{
+		shape.normals = (const float*)(data + offset);
+		offset += vectorSize;
+	}
+	if (header.flags & MeshFileHeader::HasColors)
+	{
+		shape.colors = (const float*)(data + offset);
+		offset += vectorSize;
+	}
+	shape.indices = (const unsigned int*)(data + offset);
+	for (unsigned int i = 0; i < shape.indexCount; i++)
+	{
+		if (shape.indices[i] >= shape.vertexCount)
+		{
+			printf("mesh file %s index %u out of range\n", fileName.c_str(), shape.indices[i]);
+			return false;
+		}
+	}
+
+	// the world matrix is applied at draw time, only the bounds need the transformed positions
+	shape.world = GetWorldMatrix(value["world_matrix"]);
+	TransformPoints((const Vector3*)shape.vertices, nullptr, shape.vertexCount, shape.world, vmin, vmax);
+	mesh.mappedShapes.push_back(shape);
+	return true;
+}
+
+/**
+* welds and optimizes the shape at firstVertex/firstIndex, which is the last one of mesh, as requested by the job.
+* welding and vertex reordering need one normal and one color per vertex.
+*/
+static void ProcessShape(MeshData& mesh, size_t firstVertex, size_t firstIndex, const RenderParams& params)
+{
+	size_t vertexCount = mesh.vertexBuffer.size() - firstVertex;
+	size_t indexCount = mesh.indexBuffer.size() - firstIndex;
+	if (indexCount < 3 || vertexCount == 0)
+		return;
+	// table indices are not validated while parsing, leave shapes with bad indices as they are
+	unsigned int* indices = &mesh.indexBuffer[firstIndex];
+	for (size_t i = 0; i < indexCount; i++)
+	{
+		if (indices[i] < firstVertex || indices[i] - firstVertex >= vertexCount)
+			return;
+	}
+	for (size_t i = 0; i < indexCount; i++)
+		indices[i] -= (unsigned int)firstVertex;
+
+	bool perVertex = mesh.normalBuffer.size() == mesh.vertexBuffer.size() && mesh.colorBuffer.size() == mesh.vertexBuffer.size();
+	if (params.weld >= 0 && perVertex)
+	{
+		vertexCount = WeldVertices(&mesh.vertexBuffer[firstVertex], &mesh.normalBuffer[firstVertex], &mesh.colorBuffer[firstVertex], vertexCount, indices, indexCount, params.weld);
+		mesh.vertexBuffer.resize(firstVertex + vertexCount);
+		mesh.normalBuffer.resize(firstVertex + vertexCount);
+		mesh.colorBuffer.resize(firstVertex + vertexCount);
+	}
+
+	if (params.optimize)
+	{
+		OptimizeTriangleOrder(indices, indexCount, &mesh.vertexBuffer[firstVertex], vertexCount);
+		if (perVertex)
+		{
+			std::vector<unsigned int> remap;
+			OptimizeVertexFetch(indices, indexCount, vertexCount, remap);
+			std::vector<Vector3>* buffers[3] = { &mesh.vertexBuffer, &mesh.normalBuffer, &mesh.colorBuffer };
+			std::vector<Vector3> old;
+			for (auto buffer : buffers)
+			{
+				old.assign(buffer->begin() + firstVertex, buffer->end());
+				for (size_t v = 0; v < vertexCount; v++)
+					(*buffer)[firstVertex + remap[v]] = old[v];
+			}
+		}
+	}
+
+	for (size_t i = 0; i < indexCount; i++)
+		indices[i] += (unsigned int)firstVertex;
+}
+
+/** mixes the options that change how a shape is processed into its cache key */
+static void HashShapeOptions(const RenderParams& params, unsigned long long& hash)
+{
+	const float options[2] = { params.optimize ? 1.0f : 0.0f, params.weld };
+	const unsigned char* bytes = (const unsigned char*)options;
+	for (size_t i = 0; i < sizeof(options); i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+}
+
+/**
+* level of detail: when the shapes have more triangles than the output has pixels (width * height), each shape is simplified towards
+* its share of that budget, on a grid between half a pixel and two output pixels. Anti-aliasing does not raise the budget.
+*/
+static void DecimateMesh(MeshData& mesh, const std::vector<size_t>& shapeStarts, const RenderParams& params)
+{
+	size_t budget = (size_t)params.width * params.height;
+	size_t triangleCount = mesh.indexBuffer.size() / 3;
+	float scale = std::max(std::max(mesh.extents.x, mesh.extents.y), mesh.extents.z);
+	if (triangleCount <= budget || scale <= 0 || shapeStarts.size() != mesh.shapes.size())
+		return;
+	if (mesh.normalBuffer.size() != mesh.vertexBuffer.size() || mesh.colorBuffer.size() != mesh.vertexBuffer.size())
+		return;
+	// the view maps 2 * scale to the smaller side of the output frames
+	float pixelSize = 2.0f * scale / (float)std::min(params.width, params.height);
+
+	// build into the spare buffers, the replaced ones become the spares of the next job
+	std::vector<Vector3>& vertexBuffer = mesh.spareVertexBuffer;
+	std::vector<Vector3>& normalBuffer = mesh.spareNormalBuffer;
+	std::vector<Vector3>& colorBuffer = mesh.spareColorBuffer;
+	std::vector<unsigned int>& indexBuffer = mesh.spareIndexBuffer;
+	vertexBuffer.clear();
+	normalBuffer.clear();
+	colorBuffer.clear();
+	indexBuffer.clear();
+	std::vector<Vector3> shapeVertices, shapeNormals, shapeColors;
+	std::vector<unsigned int> shapeIndices, localIndices;
+	size_t firstIndex = 0;
+	for (size_t s = 0; s < mesh.shapes.size(); s++)
+	{
+		size_t firstVertex = shapeStarts[s];
+		size_t vertexCount = (s + 1 < shapeStarts.size() ? shapeStarts[s + 1] : mesh.vertexBuffer.size()) - firstVertex;
+		size_t indexCount = (size_t)mesh.shapes[s];
+		size_t share = std::max((size_t)1, budget * (indexCount / 3) / triangleCount);
+		const unsigned int* indices = indexCount > 0 ? &mesh.indexBuffer[firstIndex] : nullptr;
+		firstIndex += indexCount;
+
+		localIndices.resize(indexCount);
+		bool valid = true;
+		for (size_t i = 0; i < indexCount && valid; i++)
+		{
+			valid = indices[i] >= firstVertex && indices[i] - firstVertex < vertexCount;
+			localIndices[i] = indices[i] - (unsigned int)firstVertex;
+		}
+
+		if (valid && indexCount / 3 > share)
+		{
+			// a grid of cell size s leaves about two triangles per s * s of surface
+			double area = 0;
+			for (size_t t = 0; t + 2 < indexCount; t += 3)
+			{
+				Vector3 e1 = mesh.vertexBuffer[indices[t + 1]] - mesh.vertexBuffer[indices[t]];
+				Vector3 e2 = mesh.vertexBuffer[indices[t + 2]] - mesh.vertexBuffer[indices[t]];
+				Vector3 n(e1.y * e2.z - e1.z * e2.y, e1.z * e2.x - e1.x * e2.z, e1.x * e2.y - e1.y * e2.x);
+				area += 0.5 * std::sqrt((double)(n.x * n.x + n.y * n.y + n.z * n.z));
+			}
+			float cellSize = (float)std::sqrt(2.0 * area / (double)share);
+			cellSize = std::min(std::max(cellSize, pixelSize * 0.5f), pixelSize * 2.0f);
+			DecimateShape(&mesh.vertexBuffer[firstVertex], &mesh.normalBuffer[firstVertex], &mesh.colorBuffer[firstVertex], vertexCount,
+				&localIndices[0], indexCount, cellSize, shapeVertices, shapeNormals, shapeColors, shapeIndices);
+		}
+		else
+		{
+			shapeVertices.assign(mesh.vertexBuffer.begin() + firstVertex, mesh.vertexBuffer.begin() + firstVertex + vertexCount);
+			shapeNormals.assign(mesh.normalBuffer.begin() + firstVertex, mesh.normalBuffer.begin() + firstVertex + vertexCount);
+			shapeColors.assign(mesh.colorBuffer.begin() + firstVertex, mesh.colorBuffer.begin() + firstVertex + vertexCount);
+			shapeIndices.swap(localIndices);
+		}
+
+		unsigned int offset = (unsigned int)vertexBuffer.size();
+		vertexBuffer.insert(vertexBuffer.end(), shapeVertices.begin(), shapeVertices.end());
+		normalBuffer.insert(normalBuffer.end(), shapeNormals.begin(), shapeNormals.end());
+		colorBuffer.insert(colorBuffer.end(), shapeColors.begin(), shapeColors.end());
+		for (auto index : shapeIndices)
+			indexBuffer.push_back(index + offset);
+		mesh.shapes[s] = (int)shapeIndices.size();
+	}
+
+	mesh.vertexBuffer.swap(vertexBuffer);
+	mesh.normalBuffer.swap(normalBuffer);
+	mesh.colorBuffer.swap(colorBuffer);
+	mesh.indexBuffer.swap(indexBuffer);
+}
+
+void NplOSRender::BuildMesh(RenderParams& params, MeshData& mesh)
+{
+	AppendMeshes(params, params.meshes, mesh);
+	AppendShapes(params, params.renderList, mesh);
+	FinishMesh(params, mesh);
+}
+
+void NplOSRender::AppendMeshes(RenderParams& params, NPLInterface::NPLObjectProxy& meshes, MeshData& mesh)
+{
+	if (meshes.GetType() != NPLInterface::NPLObjectBase::NPLObjectType_Table)
+		return;
+	auto addMesh = [&](const string& id, NPLInterface::NPLObjectProxy& value) {
+		// a shared mesh is parsed, welded and optimized like a single shape, in its own coordinates
+		RenderParams local("", NPLInterface::NPLObjectProxy());
+		local.optimize = params.optimize;
+		local.weld = params.weld;
+		local.boundsMin = Vector3(FLT_MAX, FLT_MAX, FLT_MAX);
+		local.boundsMax = Vector3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		NPLInterface::NPLObjectProxy list;
+		list[1] = value;
+		MeshData shape;
+		AppendShapes(local, list, shape);
+
+		InstancedMesh instanced;
+		instanced.vertexBuffer.swap(shape.vertexBuffer);
+		instanced.normalBuffer.swap(shape.normalBuffer);
+		instanced.colorBuffer.swap(shape.colorBuffer);
+		instanced.indexBuffer.swap(shape.indexBuffer);
+		instanced.vmin = local.boundsMin;
+		instanced.vmax = local.boundsMax;
+		params.meshIds[id] = (int)mesh.instancedMeshes.size();
+		mesh.instancedMeshes.push_back(std::move(instanced));
+	};
+	for (NPLInterface::NPLTable::IndexIterator_Type itCur = meshes.index_begin(), itEnd = meshes.index_end(); itCur != itEnd; ++itCur)
+	{
+		char id[32];
+		snprintf(id, sizeof(id), "%d", (int)itCur->first);
+		addMesh(id, itCur->second);
+	}
+	for (NPLInterface::NPLTable::Iterator_Type itCur = meshes.begin(), itEnd = meshes.end(); itCur != itEnd; ++itCur)
+		addMesh(itCur->first, itCur->second);
+}
+
+/** places a shared mesh once per matrix of instances, or once at world_matrix, and grows the bounds by its transformed box */
+static void AppendInstances(RenderParams& params, NPLInterface::NPLObjectProxy& value, MeshData& mesh, Vector3& vmin, Vector3& vmax)
+{
+	string id = GetJobId(value["mesh"]);
+	auto meshId = params.meshIds.find(id);
+	if (meshId == params.meshIds.end())
+	{
+		printf("unknown mesh %s\n", id.c_str());
+		return;
+	}
+	const InstancedMesh& shared = mesh.instancedMeshes[meshId->second];
+	if (shared.indexBuffer.empty())
+		return;
+
+	std::vector<Matrix4> matrices;
+	NPLInterface::NPLObjectProxy& instances = value["instances"];
+	if (instances.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_Table)
+	{
+		for (NPLInterface::NPLTable::IndexIterator_Type itCur = instances.index_begin(), itEnd = instances.index_end(); itCur != itEnd; ++itCur)
+			matrices.push_back(GetWorldMatrix(itCur->second));
+	}
+	else
+		matrices.push_back(GetWorldMatrix(value["world_matrix"]));
+
+	Vector3 corners[8];
+	for (int k = 0; k < 8; k++)
+		corners[k] = Vector3((k & 1) ? shared.vmax.x : shared.vmin.x, (k & 2) ? shared.vmax.y : shared.vmin.y, (k & 4) ? shared.vmax.z : shared.vmin.z);
+	for (auto& m : matrices)
+	{
+		MeshInstance instance;
+		instance.mesh = meshId->second;
+		instance.world = m;
+		mesh.instances.push_back(instance);
+		TransformPoints(corners, nullptr, 8, m, vmin, vmax);
+	}
+}
+
+void NplOSRender::AppendShapes(RenderParams& params, NPLInterface::NPLObjectProxy& renderList, MeshData& mesh)
 {
-	std::vector<Vector3> vertexBuffer;
-	std::vector<Vector3> normalBuffer;
-	std::vector<Vector3> colorBuffer;
-	std::vector<unsigned int> indexBuffer;
-	std::vector<int> shapes;
+	std::vector<Vector3>& vertexBuffer = mesh.vertexBuffer;
+	std::vector<Vector3>& normalBuffer = mesh.normalBuffer;
+	std::vector<Vector3>& colorBuffer = mesh.colorBuffer;
+	std::vector<unsigned int>& indexBuffer = mesh.indexBuffer;
+	std::vector<int>& shapes = mesh.shapes;
 
-	Vector3 vmax(0, 0, 0);
-	Vector3 vmin(0, 0, 0);
+	// bounds and shape starts carry over from the previous chunks of a session
+	Vector3& vmax = params.boundsMax;
+	Vector3& vmin = params.boundsMin;
+
+	// size the buffers from the table counts first, so that they are not regrown while parsing
+	size_t vertexCount = 0, indexCount = 0;
+	for (NPLInterface::NPLTable::IndexIterator_Type itCur = renderList.index_begin(), itEnd = renderList.index_end(); itCur != itEnd; ++itCur)
+	{
+		NPLInterface::NPLObjectProxy& value = itCur->second;
+		NPLInterface::NPLObjectProxy& vertices = value["vertices"];
+		NPLInterface::NPLObjectProxy& indices = value["indices"];
+		if (vertices.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_String)
+			vertexCount += ((const string&)vertices).size() / sizeof(Vector3);
+		else if (vertices.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_Table)
+			vertexCount += std::distance(vertices.index_begin(), vertices.index_end());
+		if (indices.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_String)
+			indexCount += ((const string&)indices).size() / sizeof(unsigned int);
+		else if (indices.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_Table)
+			indexCount += std::distance(indices.index_begin(), indices.index_end());
+	}
+	// chunks of a session grow the buffers geometrically, not by exactly one chunk each time
+	vertexCount += vertexBuffer.size();
+	indexCount += indexBuffer.size();
+	if (vertexCount > vertexBuffer.capacity())
+		vertexCount = std::max(vertexCount, vertexBuffer.capacity() * 2);
+	if (indexCount > indexBuffer.capacity())
+		indexCount = std::max(indexCount, indexBuffer.capacity() * 2);
+	vertexBuffer.reserve(vertexCount);
+	normalBuffer.reserve(vertexCount);
+	colorBuffer.reserve(vertexCount);
+	indexBuffer.reserve(indexCount);
 
-	int lastVCount = 0;
+	std::map<string, std::shared_ptr<MappedFile> > files;
+	std::vector<size_t>& shapeStarts = params.shapeStarts;
+	int lastVCount = (int)vertexBuffer.size();
 	for (NPLInterface::NPLTable::IndexIterator_Type itCur = renderList.index_begin(), itEnd = renderList.index_end(); itCur != itEnd; ++itCur)
 	{
 		NPLInterface::NPLObjectProxy& value = itCur->second;
@@ -229,74 +1942,203 @@ GLuint NplOSRender::CreateDisplayList(NPLInterface::NPLObjectProxy& renderList,
 		NPLInterface::NPLObjectProxy& indices = value["indices"];
 		NPLInterface::NPLObjectProxy& matrix = value["world_matrix"];
 
-		for (NPLInterface::NPLTable::IndexIterator_Type vCur = vertices.index_begin(), vEnd = vertices.index_end(); vCur != vEnd; ++vCur)
+		if (value["mesh_file"].GetType() == NPLInterface::NPLObjectBase::NPLObjectType_String)
 		{
-			NPLInterface::NPLObjectProxy& vertex = vCur->second;
-			Vector3 point(Vector3((float)(double)vertex[1], (float)(double)vertex[2], (float)(double)vertex[3]));
-			Matrix4 m(1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1);
-			int i = 0;
-			for (NPLInterface::NPLTable::IndexIterator_Type mCur = matrix.index_begin(), mEnd = matrix.index_end(); mCur != mEnd; ++mCur)
-			{
-				m._m[i] = (float)(double)mCur->second;
-				i++;
-			}
-			point = point * m;
-			vertexBuffer.push_back(point);
-
-			if (point.x > vmax.x) vmax.x = point.x;	if (point.x < vmin.x) vmin.x = point.x;
-			if (point.y > vmax.y) vmax.y = point.y;	if (point.y < vmin.x) vmin.y = point.y;
-			if (point.z > vmax.z) vmax.z = point.z;	if (point.z < vmin.x) vmin.z = point.z;
+			AppendMappedShape(value, mesh, files, vmin, vmax);
+			continue;
+		}
+		NPLInterface::NPLObjectProxy& meshRef = value["mesh"];
+		if (meshRef.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_String || meshRef.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_Number)
+		{
+			AppendInstances(params, value, mesh, vmin, vmax);
+			continue;
 		}
-		for (NPLInterface::NPLTable::IndexIterator_Type nCur = normals.index_begin(), nEnd = normals.index_end(); nCur != nEnd; ++nCur)
+		shapeStarts.push_back(lastVCount);
+
+		// processed shapes are cached with their own bounds, so that a cache hit can skip parsing
+		bool process = params.optimize || params.weld >= 0;
+		size_t firstIndex = indexBuffer.size();
+		unsigned long long shapeKey = 14695981039346656037ULL;
+		Vector3 shapeMax(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		Vector3 shapeMin(FLT_MAX, FLT_MAX, FLT_MAX);
+		if (process)
 		{
-			NPLInterface::NPLObjectProxy& normal = nCur->second;
-			normalBuffer.push_back(Vector3((float)(double)normal[1], (float)(double)normal[2], (float)(double)normal[3]));
+			HashNPLObject(value, shapeKey);
+			HashShapeOptions(params, shapeKey);
+			if (m_shapeCache.Append(shapeKey, mesh, vmin, vmax))
+			{
+				shapes.push_back((int)(indexBuffer.size() - firstIndex));
+				lastVCount = vertexBuffer.size();
+				continue;
+			}
 		}
-		for (NPLInterface::NPLTable::IndexIterator_Type cCur = colors.index_begin(), cEnd = colors.index_end(); cCur != cEnd; ++cCur)
+		Vector3& boundsMin = process ? shapeMin : vmin;
+		Vector3& boundsMax = process ? shapeMax : vmax;
+
+		if (vertices.GetType() == NPLInterface::NPLObjectBase::NPLObjectType_String)
+			shapes.push_back(AppendPackedShape(value, mesh, boundsMin, boundsMax));
+		else
 		{
-			NPLInterface::NPLObjectProxy& color = cCur->second;
-			colorBuffer.push_back(Vector3((float)(double)color[1], (float)(double)color[2], (float)(double)color[3]));
+			for (NPLInterface::NPLTable::IndexIterator_Type vCur = vertices.index_begin(), vEnd = vertices.index_end(); vCur != vEnd; ++vCur)
+			{
+				NPLInterface::NPLObjectProxy& vertex = vCur->second;
+				vertexBuffer.push_back(Vector3((float)(double)vertex[1], (float)(double)vertex[2], (float)(double)vertex[3]));
+			}
+			size_t firstNormal = normalBuffer.size();
+			for (NPLInterface::NPLTable::IndexIterator_Type nCur = normals.index_begin(), nEnd = normals.index_end(); nCur != nEnd; ++nCur)
+			{
+				NPLInterface::NPLObjectProxy& normal = nCur->second;
+				normalBuffer.push_back(Vector3((float)(double)normal[1], (float)(double)normal[2], (float)(double)normal[3]));
+			}
+
+			// the matrix is parsed once per shape, then positions, normals and bounds are done in one pass each
+			Matrix4 m = GetWorldMatrix(matrix);
+			if (vertexBuffer.size() > (size_t)lastVCount)
+				TransformPoints(&vertexBuffer[lastVCount], &vertexBuffer[lastVCount], vertexBuffer.size() - lastVCount, m, boundsMin, boundsMax);
+			if (normalBuffer.size() > firstNormal)
+				TransformNormals(&normalBuffer[firstNormal], normalBuffer.size() - firstNormal, m);
+			for (NPLInterface::NPLTable::IndexIterator_Type cCur = colors.index_begin(), cEnd = colors.index_end(); cCur != cEnd; ++cCur)
+			{
+				NPLInterface::NPLObjectProxy& color = cCur->second;
+				colorBuffer.push_back(Vector3((float)(double)color[1], (float)(double)color[2], (float)(double)color[3]));
+			}
+
+			int i = 0;
+			for (NPLInterface::NPLTable::IndexIterator_Type iCur = indices.index_begin(), iEnd = indices.index_end(); iCur != iEnd; ++iCur)
+			{
+				unsigned int index = (unsigned int)(double)iCur->second - 1;
+				indexBuffer.push_back(index + lastVCount);
+				i++;
+			}
+			shapes.push_back(i);
 		}
 
-		int i = 0;
-		for (NPLInterface::NPLTable::IndexIterator_Type iCur = indices.index_begin(), iEnd = indices.index_end(); iCur != iEnd; ++iCur)
+		if (process)
 		{
-			unsigned int index = (unsigned int)(double)iCur->second - 1;
-			indexBuffer.push_back(index + lastVCount);
-			i++;
+			ProcessShape(mesh, lastVCount, firstIndex, params);
+			m_shapeCache.Insert(shapeKey, mesh, lastVCount, firstIndex, shapeMin, shapeMax);
+			if (shapeMax.x > vmax.x) vmax.x = shapeMax.x;	if (shapeMin.x < vmin.x) vmin.x = shapeMin.x;
+			if (shapeMax.y > vmax.y) vmax.y = shapeMax.y;	if (shapeMin.y < vmin.y) vmin.y = shapeMin.y;
+			if (shapeMax.z > vmax.z) vmax.z = shapeMax.z;	if (shapeMin.z < vmin.z) vmin.z = shapeMin.z;
 		}
-		shapes.push_back(i);
 		lastVCount = vertexBuffer.size();
 	}
 
-	center = (vmax + vmin)*0.5f;
-	extents = (vmax - vmin)/**0.5f*/; //Used to scale the model, don't need to div2 
+}
+
+void NplOSRender::FinishMesh(RenderParams& params, MeshData& mesh)
+{
+	Vector3& vmax = params.boundsMax;
+	Vector3& vmin = params.boundsMin;
+	mesh.center = (vmax + vmin)*0.5f;
+	mesh.extents = (vmax - vmin)/**0.5f*/; //Used to scale the model, don't need to div2 
+
+	if (params.lod)
+		DecimateMesh(mesh, params.shapeStarts, params);
+}
 
+GLuint NplOSRender::CreateDisplayList(MeshData& mesh)
+{
 	//MeshPhongMaterial
 	float shininess = 100.0f;
 	float diffuseColor[3] = { 1.0f, 1.0f, 1.0f };
 	float specularColor[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
 
-	GLuint id = glGenLists(1);
+	GLuint id = glGenLists(1 + (GLsizei)mesh.instancedMeshes.size());
 	if (!id) return id;
 
 	glEnableClientState(GL_NORMAL_ARRAY);
 	glEnableClientState(GL_COLOR_ARRAY);
 	glEnableClientState(GL_VERTEX_ARRAY);
-	glNormalPointer(GL_FLOAT, 0, &normalBuffer[0]);
-	glColorPointer(3, GL_FLOAT, 0, &colorBuffer[0]);
-	glVertexPointer(3, GL_FLOAT, 0, &vertexBuffer[0]);
+	// each instanced mesh gets its own list after the job's list, which is called once per instance
+	for (size_t i = 0; i < mesh.instancedMeshes.size(); i++)
+	{
+		const InstancedMesh& shared = mesh.instancedMeshes[i];
+		glNormalPointer(GL_FLOAT, 0, shared.normalBuffer.data());
+		glColorPointer(3, GL_FLOAT, 0, shared.colorBuffer.data());
+		glVertexPointer(3, GL_FLOAT, 0, shared.vertexBuffer.data());
+		glNewList(id + 1 + (GLuint)i, GL_COMPILE);
+		glDrawElements(GL_TRIANGLES, (GLsizei)shared.indexBuffer.size(), GL_UNSIGNED_INT, shared.indexBuffer.data());
+		glEndList();
+	}
+	glNormalPointer(GL_FLOAT, 0, mesh.normalBuffer.data());
+	glColorPointer(3, GL_FLOAT, 0, mesh.colorBuffer.data());
+	glVertexPointer(3, GL_FLOAT, 0, mesh.vertexBuffer.data());
 
 	glNewList(id, GL_COMPILE);
 	glMaterialf(GL_FRONT_AND_BACK, GL_SHININESS, shininess);
 	glMaterialfv(GL_FRONT_AND_BACK, GL_SPECULAR, specularColor);
 	glColorMaterial(GL_FRONT_AND_BACK, GL_AMBIENT_AND_DIFFUSE);
 	glColor3fv(diffuseColor);
-	GLint start = 0;
-	for (auto range : shapes)
+	static PFNGLDRAWRANGEELEMENTSPROC drawRangeElements = (PFNGLDRAWRANGEELEMENTSPROC)OSMesaGetProcAddress("glDrawRangeElements");
+	std::vector<std::pair<size_t, size_t> > ranges;
+	mesh.GetDrawRanges(ranges);
+	for (auto& range : ranges)
+	{
+		const unsigned int* indices = &mesh.indexBuffer[range.first];
+		GLsizei count = (GLsizei)range.second;
+		if (drawRangeElements != nullptr)
+		{
+			unsigned int minIndex = indices[0], maxIndex = indices[0];
+			for (GLsizei k = 1; k < count; k++)
+			{
+				minIndex = std::min(minIndex, indices[k]);
+				maxIndex = std::max(maxIndex, indices[k]);
+			}
+			drawRangeElements(GL_TRIANGLES, minIndex, maxIndex, count, GL_UNSIGNED_INT, indices);
+		}
+		else
+			glDrawElements(GL_TRIANGLES, count, GL_UNSIGNED_INT, indices);
+	}
+
+	// mapped shapes are read straight from the file mapping while the list is compiled
+	if (!mesh.mappedShapes.empty())
+	{
+		glPushAttrib(GL_ENABLE_BIT | GL_CURRENT_BIT);
+		glEnable(GL_NORMALIZE);
+		for (auto& shape : mesh.mappedShapes)
+		{
+			if (shape.normals)
+			{
+				glEnableClientState(GL_NORMAL_ARRAY);
+				glNormalPointer(GL_FLOAT, 0, shape.normals);
+			}
+			else
+			{
+				glDisableClientState(GL_NORMAL_ARRAY);
+				glNormal3f(0, 0, 1);
+			}
+			if (shape.colors)
+			{
+				glEnableClientState(GL_COLOR_ARRAY);
+				glColorPointer(3, GL_FLOAT, 0, shape.colors);
+			}
+			else
+			{
+				glDisableClientState(GL_COLOR_ARRAY);
+				glColor3fv(diffuseColor);
+			}
+			glVertexPointer(3, GL_FLOAT, 0, shape.vertices);
+			glPushMatrix();
+			glMultMatrixf(shape.world._m);
+			glDrawElements(GL_TRIANGLES, shape.indexCount, GL_UNSIGNED_INT, shape.indices);
+			glPopMatrix();
+		}
+		glPopAttrib();
+	}
+
+	if (!mesh.instances.empty())
 	{
-		glDrawElements(GL_TRIANGLES, range, GL_UNSIGNED_INT, &indexBuffer[start]);
-		start += range;
+		glPushAttrib(GL_ENABLE_BIT);
+		glEnable(GL_NORMALIZE);
+		for (auto& instance : mesh.instances)
+		{
+			glPushMatrix();
+			glMultMatrixf(instance.world._m);
+			glCallList(id + 1 + instance.mesh);
+			glPopMatrix();
+		}
+		glPopAttrib();
 	}
 	glEndList();
 
@@ -307,49 +2149,54 @@ GLuint NplOSRender::CreateDisplayList(NPLInterface::NPLObjectProxy& renderList,
 	return id;
 }
 
-void NplOSRender::WritePng(const string& fileName, const GLubyte *buffer, int width, int height)
+static void PngWriteData(png_structp png_ptr, png_bytep data, png_size_t length)
 {
-	FILE *fp = fopen(fileName.c_str(), "wb");
-	if (fp != nullptr)
-	{
-		png_structp write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-		png_infop write_info_ptr = png_create_info_struct(write_ptr);
-		png_infop write_end_info_ptr = png_create_info_struct(write_ptr);
-		if (setjmp(png_jmpbuf(write_ptr)))
-		{
-			png_destroy_info_struct(write_ptr, &write_end_info_ptr);
-			png_destroy_write_struct(&write_ptr, &write_info_ptr);
-			fclose(fp);
-			return;
-		}
-
-		png_init_io(write_ptr, fp);
-		png_set_IHDR(write_ptr, write_info_ptr, width, height, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
-		png_colorp palette = (png_colorp)png_malloc(write_ptr, PNG_MAX_PALETTE_LENGTH * sizeof(png_color));
-		if (!palette) {
-			png_destroy_info_struct(write_ptr, &write_end_info_ptr);
-			png_destroy_write_struct(&write_ptr, &write_info_ptr);
-			fclose(fp);
-			return;
-		}
-		png_set_PLTE(write_ptr, write_info_ptr, palette, PNG_MAX_PALETTE_LENGTH);
-		png_write_info_before_PLTE(write_ptr, write_info_ptr);
-		png_write_info(write_ptr, write_info_ptr);
-		png_write_info(write_ptr, write_end_info_ptr);
+	std::vector<unsigned char>* png = (std::vector<unsigned char>*)png_get_io_ptr(png_ptr);
+	png->insert(png->end(), data, data + length);
+}
 
-		png_bytepp rows = (png_bytepp)png_malloc(write_ptr, height * sizeof(png_bytep));
-		for (int i = 0; i < height; i++)
-			rows[i] = (png_bytep)(buffer + (height - i - 1) * width * 4);
+static void PngFlush(png_structp png_ptr)
+{
+}
 
-		png_write_image(write_ptr, rows);
-		png_write_end(write_ptr, write_end_info_ptr);
-		png_free(write_ptr, rows);
-		png_free(write_ptr, palette);
+bool NplOSRender::EncodePng(const GLubyte *buffer, int width, int height, std::vector<unsigned char>& png)
+{
+	png.clear();
+	png_structp write_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+	png_infop write_info_ptr = png_create_info_struct(write_ptr);
+	png_infop write_end_info_ptr = png_create_info_struct(write_ptr);
+	if (setjmp(png_jmpbuf(write_ptr)))
+	{
 		png_destroy_info_struct(write_ptr, &write_end_info_ptr);
 		png_destroy_write_struct(&write_ptr, &write_info_ptr);
+		png.clear();
+		return false;
+	}
 
-		fclose(fp);
+	png_set_write_fn(write_ptr, &png, PngWriteData, PngFlush);
+	png_set_IHDR(write_ptr, write_info_ptr, width, height, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	png_colorp palette = (png_colorp)png_malloc(write_ptr, PNG_MAX_PALETTE_LENGTH * sizeof(png_color));
+	if (!palette) {
+		png_destroy_info_struct(write_ptr, &write_end_info_ptr);
+		png_destroy_write_struct(&write_ptr, &write_info_ptr);
+		return false;
 	}
+	png_set_PLTE(write_ptr, write_info_ptr, palette, PNG_MAX_PALETTE_LENGTH);
+	png_write_info_before_PLTE(write_ptr, write_info_ptr);
+	png_write_info(write_ptr, write_info_ptr);
+	png_write_info(write_ptr, write_end_info_ptr);
+
+	png_bytepp rows = (png_bytepp)png_malloc(write_ptr, height * sizeof(png_bytep));
+	for (int i = 0; i < height; i++)
+		rows[i] = (png_bytep)(buffer + (size_t)i * width * 4);
+
+	png_write_image(write_ptr, rows);
+	png_write_end(write_ptr, write_end_info_ptr);
+	png_free(write_ptr, rows);
+	png_free(write_ptr, palette);
+	png_destroy_info_struct(write_ptr, &write_end_info_ptr);
+	png_destroy_write_struct(&write_ptr, &write_info_ptr);
+	return true;
 }
 
 NplOSRender* NplOSRender::CreateGetSingleton()
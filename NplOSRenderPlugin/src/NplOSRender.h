@@ -7,17 +7,76 @@
 #include "GL/osmesa.h"
 #include "gl_wrap.h"
 #include "boost/noncopyable.hpp"
+#include "NplOSRenderMesh.h"
+#include "NplOSRenderQueue.h"
+#include "NplOSRenderPool.h"
+#include "NplOSRenderOptimize.h"
+#include "NplOSRenderShapeCache.h"
+#include "NplOSRenderTransform.h"
+#include "NplOSRenderShader.h"
+#include "NplOSRenderResample.h"
+#include "NplOSRenderTarget.h"
 #include <thread>
-#include <queue>
+#include <vector>
+#include <algorithm>
+#include <set>
+#include <map>
+#include <chrono>
 #include <mutex>
 #include <atomic>
 #include <condition_variable>
+#include <cfloat>
 
 struct RenderParams;
+struct RenderMessage;
+struct SessionMessage;
+/** orders queued jobs by priority first, then earliest deadline, then arrival */
+struct RenderParamsOrder
+{
+	bool operator()(const RenderParams* a, const RenderParams* b) const;
+};
+
+/** a render thread and the GL state it owns. The workers of one pool share display lists and buffers */
+struct RenderWorker
+{
+	std::thread* thread = nullptr;
+	OSMesaContext context = nullptr;
+	/** created on the first MLAA job, in the same share group so that the program and the job's buffers can be used in both */
+	OSMesaContext filtered = nullptr;
+	bool filterTried = false;
+	/** compiled on the first job, in this worker's context */
+	ShaderProgram program;
+	/** frames are drawn into it and read back into the sheet */
+	RenderTarget target;
+	/** a color buffer of a height no other worker has, so that making the context current shares nothing with other workers */
+	std::vector<unsigned char> surface;
+	/** the pool the worker belongs to, it leaves once a newer pool replaces it */
+	int pool = 0;
+	/** GLSL program or fixed-function GL, the same for all workers of a pool */
+	bool shaders = true;
+	/** set by the thread as it leaves, after it destroyed its contexts */
+	bool finished = false;
+	/** waiting for a job or for frames to help with, changed under m_mutex */
+	bool idle = false;
+};
+
+/** called with the output file name, the NPL callback file and an error string which is empty on success */
+typedef std::function<void(const string&, const string&, const string&)> RenderCallback;
+
 class NplOSRender : protected boost::noncopyable
 {
 public:
-	void PostTask(const char* msg, int length, std::function<void(const string&, const string&)> cb);
+	void PostTask(const char* msg, int length, RenderCallback cb);
+	/** number of render workers, each one owns an OSMesa context. Shrinking a started pool starts a new one right away, the old workers leave after their current jobs. */
+	void SetWorkerCount(int count);
+	/** jobs arriving when maxQueue jobs are queued are rejected; 0 means no limit */
+	void SetMaxQueue(int maxQueue);
+	/** jobs in flight hold at most memoryBudget bytes of render buffers, larger jobs are rejected; 0 means no limit */
+	void SetMemoryBudget(size_t memoryBudget);
+	/** renders with a GLSL program in core profile contexts when the driver has them, else with fixed-function GL. Changing it replaces a started pool at once, jobs in flight finish with the old kind */
+	void SetUseShaders(bool enable);
+	/** starts all workers now and lets each of them render a tiny scene, so that the first job does not pay for driver setup */
+	void Warmup();
 	static NplOSRender* CreateGetSingleton();
 
 protected:
@@ -25,20 +84,108 @@ protected:
 	~NplOSRender();
 
 private:
-	void DoTask();
-	void InitGL();
+	void StartWorkers();
+	/** starts a new pool with the current settings without waiting for the old one, whose workers leave after their current jobs. Called with m_mutex held */
+	void RestartWorkers();
+	/** joins the retired workers which have left. Called with m_mutex held */
+	void ReapWorkers();
+	void ParseTask();
+	void ParseMessage(RenderMessage& message);
+	void QueueTask(RenderParams* params);
+	/** hands a session message to the session thread, starting it on first use. Only called by the parse thread */
+	void PostSessionMessage(SessionMessage* message);
+	void SessionTask();
+	void UpdateSession(SessionMessage& message);
+	void DropSession(const string& sessionId, const string& error);
+	void BuildTask();
+	void DoTask(RenderWorker* worker);
+	/** a core profile context when shaders is set, else a fixed-function one, sharing with share */
+	OSMesaContext CreateContext(OSMesaContext share, bool shaders);
+	/** a context of the worker's share group with the MLAA post-process filter enabled, nullptr if it cannot be created */
+	OSMesaContext CreateFilteredContext(const RenderWorker& worker);
+	void WarmupTask(RenderWorker& worker);
+	void EncodeTask();
+	void WriteTask();
+	void CancelTask(const string& id);
+	bool CanStartTask();
+	/** moves the queued jobs past their deadline to expired, returns the earliest deadline of the jobs left */
+	std::chrono::steady_clock::time_point ExpireQueuedTasks(std::vector<RenderParams*>& expired);
+	void RenderTask(RenderParams* params, RenderWorker& worker);
+	void HelpRenderTask(RenderParams* params, RenderWorker& worker);
+	/** renders the frames nobody has claimed yet, through scratch when supersampled, false if the render target cannot be bound */
+	bool RenderFrames(RenderParams* params, RenderWorker& worker, OSMesaContext context, GLubyte* scratch);
+	/** renders all frames with one draw, false if the render target cannot be bound */
+	bool RenderSheet(RenderParams* params, RenderWorker& worker, GLubyte* scratch);
+	void InitGL(bool shaders);
 	void InitLights();
-	void ResizeView(int w, int h, float scale);
-	GLuint CreateDisplayList(NPLInterface::NPLObjectProxy& renderList, ParaEngine::Vector3& center, ParaEngine::Vector3& extents);
-	void WritePng(const string& fileName, const GLubyte *buffer, int width, int height);
+	void ResizeView(int w, int h, float scale, bool shaders);
+	MeshData* AcquireMesh();
+	void ReleaseMesh(MeshData* mesh);
+	void BuildMesh(RenderParams& params, MeshData& mesh);
+	void AppendMeshes(RenderParams& params, NPLInterface::NPLObjectProxy& meshes, MeshData& mesh);
+	void AppendShapes(RenderParams& params, NPLInterface::NPLObjectProxy& renderList, MeshData& mesh);
+	void FinishMesh(RenderParams& params, MeshData& mesh);
+	GLuint CreateDisplayList(MeshData& mesh);
+	bool EncodePng(const GLubyte *buffer, int width, int height, std::vector<unsigned char>& png);
 
-	std::thread* m_pThread;
-	std::queue<RenderParams*> m_queue;
+	// pipeline stages: parse -> build -> raster workers -> encode -> write
+	std::thread* m_pParseThread;
+	/** starts the parse thread with the first message, without taking m_mutex */
+	std::once_flag m_parseOnce;
+	/** builds the chunks of streamed jobs, so that big chunks do not hold up the messages behind them */
+	std::thread* m_pSessionThread;
+	std::thread* m_pBuildThread;
+	/** the current pool */
+	std::vector<RenderWorker*> m_workers;
+	/** workers of replaced pools, until they have left and been joined */
+	std::vector<RenderWorker*> m_retiredWorkers;
+	/** incremented for each new pool */
+	int m_nPool;
+	/** number of workers started so far, gives each one a surface of its own size */
+	int m_nWorkersStarted;
+	std::thread* m_pEncodeThread;
+	std::thread* m_pWriteThread;
+	int m_nWorkerCount;
+	/** the kind of the current pool, set when its first context is created */
+	bool m_bShaders;
+	/** the kind requested by SetUseShaders, m_bShaders falls back to fixed function if the driver has no core profile */
+	bool m_bUseShaders;
+	/** raw activation messages, unbounded so that PostTask never blocks the NPL runtime */
+	BoundedQueue<RenderMessage*> m_inbox;
+	std::set<RenderParams*, RenderParamsOrder> m_queue;
+	/** jobs with built geometry waiting for a raster worker, holds at most one job per worker */
+	std::deque<RenderParams*> m_rasterQueue;
+	BoundedQueue<RenderParams*> m_encodeQueue;
+	BoundedQueue<RenderParams*> m_writeQueue;
+	unsigned long long m_nSequence;
+	int m_nMaxQueue;
+	size_t m_nMemoryBudget;
+	/** bytes of render buffers reserved by the jobs in flight */
+	size_t m_nMemoryInUse;
+	/** sprite sheet buffers, reused across jobs */
+	BufferPool m_sheetPool;
+	/** cleared meshes whose buffers are reused by the next jobs */
+	std::vector<MeshData*> m_meshPool;
+	/** optimized shapes of recent jobs */
+	ShapeCache m_shapeCache;
+	/** incremented for each warm-up request, every worker warms up once per value */
+	int m_nWarmup;
+	/** messages of streamed jobs, unbounded like m_inbox */
+	BoundedQueue<SessionMessage*> m_sessionInbox;
+	/** streamed jobs which have been opened and not committed yet, changed by the session thread under m_mutex */
+	std::map<string, RenderParams*> m_sessions;
+	/** queued and running jobs by key, so that identical requests can share them */
+	std::map<string, RenderParams*> m_pending;
+	/** jobs which left the queue and have not been written yet */
+	std::vector<RenderParams*> m_running;
+	/** jobs whose remaining frames can be rendered by idle workers of the same pool */
+	std::vector<RenderParams*> m_frameJobs;
+	std::condition_variable m_frameDone;
+	/** held by the MLAA job being rendered, whose frames go through a color buffer OSMesa shares between contexts */
+	std::mutex m_filterMutex;
 	std::mutex m_mutex;
 	std::condition_variable m_condition;
 	std::atomic<bool> m_start;
 
-	OSMesaContext m_context;
-
 	static NplOSRender* m_pInstance;
 };
@@ -116,6 +116,10 @@ CORE_EXPORT_DECL ClassDescriptor* LibClassDesc(int i)
 
 CORE_EXPORT_DECL void LibInit()
 {
+	// create the render contexts and threads at load time instead of on the first request
+	NplOSRender* render = NplOSRender::CreateGetSingleton();
+	if (render != nullptr)
+		render->Warmup();
 }
 
 #ifdef WIN32
@@ -143,10 +147,14 @@ CORE_EXPORT_DECL void LibActivate(int nType, void* pVoid)
 		NplOSRender* browser = NplOSRender::CreateGetSingleton();
 		if (browser != nullptr)
 		{
-			browser->PostTask(sMsg, nMsgLength, [=](const string& fileName, const string& callback) {
+			browser->PostTask(sMsg, nMsgLength, [=](const string& fileName, const string& callback, const string& error) {
 				if (!callback.empty())
 				{
-					std::string codes = "msg = {finished_png = true,  filename = \"";
+					std::string codes;
+					if (error.empty())
+						codes = "msg = {finished_png = true,  filename = \"";
+					else
+						codes.append("msg = {finished_png = false, error = \"").append(error).append("\", filename = \"");
 					codes.append(fileName).append("\"}");
 					pState->activate(callback.c_str(), codes.c_str(), codes.length());
 				}
@@ -0,0 +1,30 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+/** read-only memory mapping of a whole file */
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool Open(const std::string& fileName);
+	void Close();
+
+	const unsigned char* GetData() const { return m_pData; }
+	size_t GetSize() const { return m_nSize; }
+
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	const unsigned char* m_pData;
+	size_t m_nSize;
+#ifdef WIN32
+	void* m_hFile;
+	void* m_hMapping;
+#else
+	int m_fd;
+#endif
+};
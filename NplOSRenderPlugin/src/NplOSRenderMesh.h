@@ -0,0 +1,117 @@
+#pragma once
+#include "ParaMath.h"
+#include "ParaVector3.h"
+#include "NplOSRenderMappedFile.h"
+#include <vector>
+#include <memory>
+#include <utility>
+#include <stdint.h>
+
+/**
+* header of a binary mesh_file, followed by vertexCount float32 xyz positions, then vertexCount normals
+* and vertexCount rgb colors when the matching flag is set, then indexCount zero based uint32 indices.
+* All values are little-endian.
+*/
+struct MeshFileHeader
+{
+	enum { HasNormals = 1, HasColors = 2 };
+	char magic[4];	// "NPLM"
+	uint32_t version;	// 1
+	uint32_t vertexCount;
+	uint32_t indexCount;
+	uint32_t flags;
+	uint32_t reserved[3];
+};
+
+/** a shape drawn straight from a memory mapped mesh_file, the arrays point into the mapping */
+struct MappedShape
+{
+	std::shared_ptr<MappedFile> file;
+	const float* vertices = nullptr;
+	const float* normals = nullptr;
+	const float* colors = nullptr;
+	const unsigned int* indices = nullptr;
+	unsigned int vertexCount = 0;
+	unsigned int indexCount = 0;
+	ParaEngine::Matrix4 world;
+};
+
+/** geometry shared by the instances of a repeated part, indices are zero based */
+struct InstancedMesh
+{
+	std::vector<ParaEngine::Vector3> vertexBuffer;
+	std::vector<ParaEngine::Vector3> normalBuffer;
+	std::vector<ParaEngine::Vector3> colorBuffer;
+	std::vector<unsigned int> indexBuffer;
+	ParaEngine::Vector3 vmin;
+	ParaEngine::Vector3 vmax;
+};
+
+/** one placement of an instanced mesh */
+struct MeshInstance
+{
+	int mesh;
+	ParaEngine::Matrix4 world;
+};
+
+/** CPU side geometry of a render job, built before the job reaches a GL context */
+struct MeshData
+{
+	std::vector<ParaEngine::Vector3> vertexBuffer;
+	std::vector<ParaEngine::Vector3> normalBuffer;
+	std::vector<ParaEngine::Vector3> colorBuffer;
+	std::vector<unsigned int> indexBuffer;
+	/** number of indices of each shape */
+	std::vector<int> shapes;
+	/** shapes loaded from mesh files, they keep their files mapped until the job is uploaded to GL */
+	std::vector<MappedShape> mappedShapes;
+	/** parts drawn once per instance of a shared mesh */
+	std::vector<InstancedMesh> instancedMeshes;
+	std::vector<MeshInstance> instances;
+	/** buffers replaced by level of detail, the next decimated job builds into them */
+	std::vector<ParaEngine::Vector3> spareVertexBuffer;
+	std::vector<ParaEngine::Vector3> spareNormalBuffer;
+	std::vector<ParaEngine::Vector3> spareColorBuffer;
+	std::vector<unsigned int> spareIndexBuffer;
+
+	ParaEngine::Vector3 center;
+	ParaEngine::Vector3 extents;
+
+	/** empties the mesh but keeps its buffers allocated, so that the next job can reuse them */
+	void Clear()
+	{
+		vertexBuffer.clear();
+		normalBuffer.clear();
+		colorBuffer.clear();
+		indexBuffer.clear();
+		shapes.clear();
+		mappedShapes.clear();
+		instancedMeshes.clear();
+		instances.clear();
+	}
+	/**
+	* index ranges of the shapes as (first index, index count). All shapes share the material, so consecutive shapes
+	* share a range; a shape whose index count is not a multiple of 3 ends its range, so that its dangling indices are dropped
+	*/
+	void GetDrawRanges(std::vector<std::pair<size_t, size_t> >& ranges) const
+	{
+		size_t start = 0;
+		size_t count = 0;
+		for (size_t i = 0; i < shapes.size(); i++)
+		{
+			count += shapes[i];
+			if (count == 0 || (shapes[i] % 3 == 0 && i + 1 < shapes.size()))
+				continue;
+			ranges.push_back(std::make_pair(start, count));
+			start += count;
+			count = 0;
+		}
+	}
+	/** bytes held by the buffers, used or not */
+	size_t GetCapacityBytes() const
+	{
+		return (vertexBuffer.capacity() + normalBuffer.capacity() + colorBuffer.capacity()) * sizeof(ParaEngine::Vector3) + indexBuffer.capacity() * sizeof(unsigned int)
+			+ (spareVertexBuffer.capacity() + spareNormalBuffer.capacity() + spareColorBuffer.capacity()) * sizeof(ParaEngine::Vector3)
+			+ spareIndexBuffer.capacity() * sizeof(unsigned int);
+	}
+};
@@ -0,0 +1,470 @@
+#include "NplOSRenderOptimize.h"
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <cmath>
+#include <cstring>
+
+using namespace ParaEngine;
+
+namespace
+{
+	const int CacheSize = 16;
+
+	struct TriangleCluster
+	{
+		size_t first;
+		size_t count;
+		float sortKey;
+	};
+
+	/** position cell of a vertex: the grid cell for a tolerance, or the exact bits of the coordinates */
+	long long GetCellCoord(float value, float tolerance)
+	{
+		if (tolerance > 0)
+			return (long long)std::floor(value / tolerance);
+		// +0.0f turns -0 into 0, so that both land in the same cell
+		value += 0.0f;
+		unsigned int bits;
+		memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+
+	unsigned long long GetCellKey(long long x, long long y, long long z)
+	{
+		return ((unsigned long long)x * 73856093ULL) ^ ((unsigned long long)y * 19349663ULL) ^ ((unsigned long long)z * 83492791ULL);
+	}
+
+	/** vertices in one grid cell: the sum of their plane quadrics and positions. They all move to one point, so that shapes stay closed */
+	struct ClusterCell
+	{
+		double quadric[10];	// a2 ab ac ad b2 bc bd c2 cd d2
+		Vector3 position;
+		int count;
+	};
+
+	/** vertices of one cell with similar attributes, hard edges and color borders keep one cluster per side */
+	struct VertexCluster
+	{
+		unsigned int cell;
+		Vector3 normal;
+		Vector3 color;
+		int count;
+	};
+
+	struct ClusterKey
+	{
+		long long x, y, z;
+		int attributes;
+		bool operator==(const ClusterKey& o) const { return x == o.x && y == o.y && z == o.z && attributes == o.attributes; }
+	};
+
+	struct ClusterKeyHash
+	{
+		size_t operator()(const ClusterKey& k) const
+		{
+			// splitmix64 finalizer, grid coordinates are too regular for the plain cell key
+			unsigned long long h = GetCellKey(k.x, k.y, k.z) ^ ((unsigned long long)k.attributes << 40);
+			h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+			return (size_t)(h ^ (h >> 31));
+		}
+	};
+
+	struct ClusterTriangle
+	{
+		unsigned int a, b, c;
+		bool operator==(const ClusterTriangle& o) const { return a == o.a && b == o.b && c == o.c; }
+	};
+
+	struct ClusterTriangleHash
+	{
+		size_t operator()(const ClusterTriangle& t) const { return (size_t)GetCellKey(t.a, t.b, t.c); }
+	};
+
+	/** dominant axis and sign of the normal, plus the color at 5 bits per channel */
+	int GetClusterAttributes(const Vector3& normal, const Vector3& color)
+	{
+		float ax = std::fabs(normal.x), ay = std::fabs(normal.y), az = std::fabs(normal.z);
+		int axis = (ax >= ay && ax >= az) ? (normal.x < 0 ? 1 : 0) : (ay >= az ? (normal.y < 0 ? 3 : 2) : (normal.z < 0 ? 5 : 4));
+		int r = std::min(31, std::max(0, (int)(color.x * 31.0f + 0.5f)));
+		int g = std::min(31, std::max(0, (int)(color.y * 31.0f + 0.5f)));
+		int b = std::min(31, std::max(0, (int)(color.z * 31.0f + 0.5f)));
+		return (axis << 15) | (r << 10) | (g << 5) | b;
+	}
+
+	/** point minimizing the quadric, or false if it is ill conditioned */
+	bool SolveQuadric(const double* q, Vector3& point)
+	{
+		double a00 = q[0], a01 = q[1], a02 = q[2], a11 = q[4], a12 = q[5], a22 = q[7];
+		double b0 = -q[3], b1 = -q[6], b2 = -q[8];
+		double c00 = a11 * a22 - a12 * a12, c01 = a02 * a12 - a01 * a22, c02 = a01 * a12 - a02 * a11;
+		double det = a00 * c00 + a01 * c01 + a02 * c02;
+		// flat or straight clusters have a (nearly) singular quadric, compare with the size of its diagonal
+		double trace = a00 + a11 + a22;
+		if (std::fabs(det) <= 1e-4 * trace * trace * trace)
+			return false;
+		double c11 = a00 * a22 - a02 * a02, c12 = a01 * a02 - a00 * a12, c22 = a00 * a11 - a01 * a01;
+		point.x = (float)((c00 * b0 + c01 * b1 + c02 * b2) / det);
+		point.y = (float)((c01 * b0 + c11 * b1 + c12 * b2) / det);
+		point.z = (float)((c02 * b0 + c12 * b1 + c22 * b2) / det);
+		return true;
+	}
+
+	bool IsNear(const Vector3& a, const Vector3& b, float tolerance)
+	{
+		return std::fabs(a.x - b.x) <= tolerance && std::fabs(a.y - b.y) <= tolerance && std::fabs(a.z - b.z) <= tolerance;
+	}
+}
+
+void OptimizeTriangleOrder(unsigned int* indices, size_t indexCount, const Vector3* vertices, size_t vertexCount)
+{
+	size_t triangleCount = indexCount / 3;
+	if (triangleCount < 2 || vertexCount == 0)
+		return;
+
+	// vertex to triangle adjacency
+	std::vector<unsigned int> liveCount(vertexCount, 0);
+	for (size_t i = 0; i < triangleCount * 3; i++)
+		liveCount[indices[i]]++;
+	std::vector<unsigned int> adjacencyOffset(vertexCount + 1, 0);
+	for (size_t v = 0; v < vertexCount; v++)
+		adjacencyOffset[v + 1] = adjacencyOffset[v] + liveCount[v];
+	std::vector<unsigned int> adjacency(triangleCount * 3);
+	{
+		std::vector<unsigned int> fill(adjacencyOffset.begin(), adjacencyOffset.end() - 1);
+		for (size_t i = 0; i < triangleCount * 3; i++)
+			adjacency[fill[indices[i]]++] = (unsigned int)(i / 3);
+	}
+
+	// Tipsify: fan around a vertex, then continue with a vertex which is still in the cache
+	std::vector<unsigned int> output;
+	output.reserve(triangleCount * 3);
+	std::vector<int> cacheTime(vertexCount, 0);
+	std::vector<char> emitted(triangleCount, 0);
+	std::vector<unsigned int> deadEnd;
+	std::vector<unsigned int> candidates;
+	std::vector<size_t> clusterStarts;
+	int time = CacheSize + 1;
+	size_t cursor = 0;
+	long long fanning = 0;
+	clusterStarts.push_back(0);
+	while (fanning >= 0)
+	{
+		candidates.clear();
+		for (unsigned int a = adjacencyOffset[fanning]; a < adjacencyOffset[fanning + 1]; a++)
+		{
+			unsigned int t = adjacency[a];
+			if (emitted[t])
+				continue;
+			emitted[t] = 1;
+			for (int k = 0; k < 3; k++)
+			{
+				unsigned int v = indices[t * 3 + k];
+				output.push_back(v);
+				deadEnd.push_back(v);
+				candidates.push_back(v);
+				liveCount[v]--;
+				if (time - cacheTime[v] > CacheSize)
+				{
+					cacheTime[v] = time;
+					time++;
+				}
+			}
+		}
+
+		long long next = -1;
+		int best = -1;
+		for (auto v : candidates)
+		{
+			if (liveCount[v] == 0)
+				continue;
+			int priority = 0;
+			if (time - cacheTime[v] + 2 * (int)liveCount[v] <= CacheSize)
+				priority = time - cacheTime[v];
+			if (priority > best)
+			{
+				best = priority;
+				next = v;
+			}
+		}
+		if (next < 0)
+		{
+			// dead end, the next fan starts a new cluster
+			while (!deadEnd.empty() && next < 0)
+			{
+				unsigned int v = deadEnd.back();
+				deadEnd.pop_back();
+				if (liveCount[v] > 0)
+					next = v;
+			}
+			while (next < 0 && cursor < vertexCount)
+			{
+				if (liveCount[cursor] > 0)
+					next = (long long)cursor;
+				cursor++;
+			}
+			if (next >= 0 && output.size() > clusterStarts.back())
+				clusterStarts.push_back(output.size());
+		}
+		fanning = next;
+	}
+	if (output.size() != triangleCount * 3)
+		return;
+
+	// sort clusters so that the ones facing away from the mesh center come first
+	Vector3 meshCenter(0, 0, 0);
+	for (size_t v = 0; v < vertexCount; v++)
+		meshCenter = meshCenter + vertices[v];
+	meshCenter = meshCenter * (1.0f / (float)vertexCount);
+
+	std::vector<TriangleCluster> clusters;
+	for (size_t c = 0; c < clusterStarts.size(); c++)
+	{
+		TriangleCluster cluster;
+		cluster.first = clusterStarts[c];
+		cluster.count = (c + 1 < clusterStarts.size() ? clusterStarts[c + 1] : output.size()) - cluster.first;
+		Vector3 centroid(0, 0, 0);
+		Vector3 normal(0, 0, 0);
+		for (size_t i = cluster.first; i < cluster.first + cluster.count; i += 3)
+		{
+			const Vector3& p0 = vertices[output[i]];
+			const Vector3& p1 = vertices[output[i + 1]];
+			const Vector3& p2 = vertices[output[i + 2]];
+			Vector3 e1 = p1 - p0, e2 = p2 - p0;
+			// area weighted normal
+			Vector3 n(e1.y * e2.z - e1.z * e2.y, e1.z * e2.x - e1.x * e2.z, e1.x * e2.y - e1.y * e2.x);
+			normal = normal + n;
+			centroid = centroid + p0 + p1 + p2;
+		}
+		centroid = centroid * (1.0f / (float)cluster.count);
+		Vector3 d = centroid - meshCenter;
+		cluster.sortKey = d.x * normal.x + d.y * normal.y + d.z * normal.z;
+		clusters.push_back(cluster);
+	}
+	std::stable_sort(clusters.begin(), clusters.end(), [](const TriangleCluster& a, const TriangleCluster& b) { return a.sortKey > b.sortKey; });
+
+	size_t n = 0;
+	for (auto& cluster : clusters)
+	{
+		std::copy(output.begin() + cluster.first, output.begin() + cluster.first + cluster.count, indices + n);
+		n += cluster.count;
+	}
+}
+
+size_t OptimizeVertexFetch(unsigned int* indices, size_t indexCount, size_t vertexCount, std::vector<unsigned int>& remap)
+{
+	const unsigned int unused = (unsigned int)-1;
+	remap.assign(vertexCount, unused);
+	unsigned int next = 0;
+	for (size_t i = 0; i < indexCount; i++)
+	{
+		unsigned int& target = remap[indices[i]];
+		if (target == unused)
+			target = next++;
+		indices[i] = target;
+	}
+	size_t used = next;
+	for (size_t v = 0; v < vertexCount; v++)
+	{
+		if (remap[v] == unused)
+			remap[v] = next++;
+	}
+	return used;
+}
+
+size_t WeldVertices(Vector3* vertices, Vector3* normals, Vector3* colors, size_t vertexCount, unsigned int* indices, size_t indexCount, float tolerance)
+{
+	std::unordered_multimap<unsigned long long, unsigned int> cells;
+	cells.reserve(vertexCount);
+	std::vector<unsigned int> remap(vertexCount);
+	// with a tolerance, a match can lie in any neighbouring cell
+	int range = tolerance > 0 ? 1 : 0;
+	size_t count = 0;
+	for (size_t v = 0; v < vertexCount; v++)
+	{
+		const Vector3 point = vertices[v];
+		const Vector3 normal = normals[v];
+		const Vector3 color = colors[v];
+		long long cx = GetCellCoord(point.x, tolerance);
+		long long cy = GetCellCoord(point.y, tolerance);
+		long long cz = GetCellCoord(point.z, tolerance);
+		long long found = -1;
+		for (int dx = -range; dx <= range && found < 0; dx++)
+		{
+			for (int dy = -range; dy <= range && found < 0; dy++)
+			{
+				for (int dz = -range; dz <= range && found < 0; dz++)
+				{
+					auto matches = cells.equal_range(GetCellKey(cx + dx, cy + dy, cz + dz));
+					for (auto it = matches.first; it != matches.second; ++it)
+					{
+						unsigned int w = it->second;
+						if (IsNear(vertices[w], point, tolerance) && IsNear(normals[w], normal, tolerance) && IsNear(colors[w], color, tolerance))
+						{
+							found = w;
+							break;
+						}
+					}
+				}
+			}
+		}
+		if (found >= 0)
+		{
+			remap[v] = (unsigned int)found;
+			continue;
+		}
+		vertices[count] = point;
+		normals[count] = normal;
+		colors[count] = color;
+		cells.insert(std::make_pair(GetCellKey(cx, cy, cz), (unsigned int)count));
+		remap[v] = (unsigned int)count++;
+	}
+	for (size_t i = 0; i < indexCount; i++)
+		indices[i] = remap[indices[i]];
+	return count;
+}
+
+size_t DecimateShape(const Vector3* vertices, const Vector3* normals, const Vector3* colors, size_t vertexCount,
+	const unsigned int* indices, size_t indexCount, float cellSize,
+	std::vector<Vector3>& outVertices, std::vector<Vector3>& outNormals, std::vector<Vector3>& outColors, std::vector<unsigned int>& outIndices)
+{
+	outVertices.clear();
+	outNormals.clear();
+	outColors.clear();
+	outIndices.clear();
+	if (cellSize <= 0)
+		return 0;
+
+	// coincident vertices which are not shared by index (seams, hard edges) could straddle a cell border and open a crack,
+	// so positions are first rounded to a fine grid centred on zero, where such seams usually lie, and cells are taken
+	// from the rounded position
+	const long long snapsPerCell = 1024;
+	float snap = cellSize / (float)snapsPerCell;
+	std::unordered_map<ClusterKey, unsigned int, ClusterKeyHash> cellKeys;
+	cellKeys.reserve(vertexCount / 2);
+	std::vector<ClusterCell> cells;
+	std::vector<unsigned int> cellOf(vertexCount);
+	for (size_t v = 0; v < vertexCount; v++)
+	{
+		const Vector3& point = vertices[v];
+		long long snapped[3] = { (long long)std::floor(point.x / snap + 0.5f), (long long)std::floor(point.y / snap + 0.5f), (long long)std::floor(point.z / snap + 0.5f) };
+		ClusterKey key;
+		// floor division, so that negative coordinates get their own cells
+		key.x = snapped[0] >= 0 ? snapped[0] / snapsPerCell : -((-snapped[0] + snapsPerCell - 1) / snapsPerCell);
+		key.y = snapped[1] >= 0 ? snapped[1] / snapsPerCell : -((-snapped[1] + snapsPerCell - 1) / snapsPerCell);
+		key.z = snapped[2] >= 0 ? snapped[2] / snapsPerCell : -((-snapped[2] + snapsPerCell - 1) / snapsPerCell);
+		key.attributes = 0;
+		auto it = cellKeys.find(key);
+		if (it == cellKeys.end())
+		{
+			it = cellKeys.insert(std::make_pair(key, (unsigned int)cells.size())).first;
+			cells.push_back(ClusterCell());
+		}
+		cellOf[v] = it->second;
+		ClusterCell& cell = cells[cellOf[v]];
+		cell.position = cell.position + point;
+		cell.count++;
+	}
+
+	// split the cells by attributes
+	std::unordered_map<ClusterKey, unsigned int, ClusterKeyHash> clusterKeys;
+	clusterKeys.reserve(cells.size() * 2);
+	std::vector<VertexCluster> clusters;
+	std::vector<unsigned int> clusterOf(vertexCount);
+	for (size_t v = 0; v < vertexCount; v++)
+	{
+		ClusterKey key;
+		key.x = cellOf[v];
+		key.y = key.z = 0;
+		key.attributes = GetClusterAttributes(normals[v], colors[v]);
+		auto it = clusterKeys.find(key);
+		if (it == clusterKeys.end())
+		{
+			it = clusterKeys.insert(std::make_pair(key, (unsigned int)clusters.size())).first;
+			VertexCluster cluster;
+			cluster.cell = cellOf[v];
+			cluster.normal = Vector3(0, 0, 0);
+			cluster.color = Vector3(0, 0, 0);
+			cluster.count = 0;
+			clusters.push_back(cluster);
+		}
+		VertexCluster& cluster = clusters[it->second];
+		cluster.normal = cluster.normal + normals[v];
+		cluster.color = cluster.color + colors[v];
+		cluster.count++;
+		clusterOf[v] = it->second;
+	}
+
+	// area weighted plane quadrics of the triangles, added to the cells of their corners
+	size_t triangleCount = indexCount / 3;
+	for (size_t t = 0; t < triangleCount; t++)
+	{
+		const Vector3& p0 = vertices[indices[t * 3]];
+		const Vector3& p1 = vertices[indices[t * 3 + 1]];
+		const Vector3& p2 = vertices[indices[t * 3 + 2]];
+		double e1x = p1.x - p0.x, e1y = p1.y - p0.y, e1z = p1.z - p0.z;
+		double e2x = p2.x - p0.x, e2y = p2.y - p0.y, e2z = p2.z - p0.z;
+		// the cross product has the length of twice the area, so the quadric is weighted by area
+		double a = e1y * e2z - e1z * e2y, b = e1z * e2x - e1x * e2z, c = e1x * e2y - e1y * e2x;
+		double length = std::sqrt(a * a + b * b + c * c);
+		if (length == 0)
+			continue;
+		double d = -(a * p0.x + b * p0.y + c * p0.z) / length;
+		double q[10] = { a * a / length, a * b / length, a * c / length, a * d, b * b / length, b * c / length, b * d, c * c / length, c * d, d * d * length };
+		for (int k = 0; k < 3; k++)
+		{
+			ClusterCell& cell = cells[cellOf[indices[t * 3 + k]]];
+			for (int i = 0; i < 10; i++)
+				cell.quadric[i] += q[i];
+		}
+	}
+
+	std::vector<Vector3> cellPoints(cells.size());
+	for (size_t c = 0; c < cells.size(); c++)
+	{
+		ClusterCell& cell = cells[c];
+		Vector3 mean = cell.position * (1.0f / (float)cell.count);
+		Vector3 point;
+		// keep the optimal point near its cell, flat or thin cells fall back to the mean
+		if (!SolveQuadric(cell.quadric, point) || !IsNear(point, mean, cellSize))
+			point = mean;
+		cellPoints[c] = point;
+	}
+
+	outVertices.resize(clusters.size());
+	outNormals.resize(clusters.size());
+	outColors.resize(clusters.size());
+	for (size_t c = 0; c < clusters.size(); c++)
+	{
+		VertexCluster& cluster = clusters[c];
+		outVertices[c] = cellPoints[cluster.cell];
+		float length = std::sqrt(cluster.normal.x * cluster.normal.x + cluster.normal.y * cluster.normal.y + cluster.normal.z * cluster.normal.z);
+		outNormals[c] = length > 0 ? cluster.normal * (1.0f / length) : Vector3(0, 0, 1);
+		outColors[c] = cluster.color * (1.0f / (float)cluster.count);
+	}
+
+	// keep the triangles spanning three cells, once each with their winding
+	std::unordered_set<ClusterTriangle, ClusterTriangleHash> emitted;
+	emitted.reserve(triangleCount / 4);
+	outIndices.reserve(triangleCount);
+	for (size_t t = 0; t < triangleCount; t++)
+	{
+		unsigned int c0 = clusterOf[indices[t * 3]], c1 = clusterOf[indices[t * 3 + 1]], c2 = clusterOf[indices[t * 3 + 2]];
+		unsigned int s0 = clusters[c0].cell, s1 = clusters[c1].cell, s2 = clusters[c2].cell;
+		if (s0 == s1 || s1 == s2 || s0 == s2)
+			continue;
+		// rotate the smallest index first, so that the same triangle gives the same key
+		while (c0 > c1 || c0 > c2)
+		{
+			unsigned int tmp = c0; c0 = c1; c1 = c2; c2 = tmp;
+		}
+		ClusterTriangle triangle = { c0, c1, c2 };
+		if (!emitted.insert(triangle).second)
+			continue;
+		outIndices.push_back(c0);
+		outIndices.push_back(c1);
+		outIndices.push_back(c2);
+	}
+	return outIndices.size() / 3;
+}
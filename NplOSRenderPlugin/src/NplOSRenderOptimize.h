@@ -0,0 +1,36 @@
+#pragma once
+#include "ParaMath.h"
+#include "ParaVector3.h"
+#include <vector>
+#include <cstddef>
+
+/**
+* reorders the triangles of one shape for the post-transform vertex cache (Tipsify), then reorders the
+* clusters found on the way so that outward facing parts are drawn first, which reduces overdraw from any
+* turntable view. indices are zero based and refer to vertexCount vertices.
+*/
+void OptimizeTriangleOrder(unsigned int* indices, size_t indexCount, const ParaEngine::Vector3* vertices, size_t vertexCount);
+
+/**
+* renumbers the vertices of one shape in the order the indices first use them, so that vertex fetch walks
+* memory forward. The permutation is written to remap (old index to new index) and indices are rewritten.
+* returns the number of referenced vertices; unreferenced ones are moved to the end.
+*/
+size_t OptimizeVertexFetch(unsigned int* indices, size_t indexCount, size_t vertexCount, std::vector<unsigned int>& remap);
+
+/**
+* merges the vertices of one shape whose positions, normals and colors all lie within tolerance of each other
+* (identical ones if tolerance is 0), compacting the three arrays in place and rewriting the zero based indices.
+* returns the new vertex count.
+*/
+size_t WeldVertices(ParaEngine::Vector3* vertices, ParaEngine::Vector3* normals, ParaEngine::Vector3* colors, size_t vertexCount, unsigned int* indices, size_t indexCount, float tolerance);
+
+/**
+* simplifies one shape by clustering its vertices on a grid of cellSize, the quadric error variant of Lindstrom:
+* the vertices of a cell move to the point with the least squared distance to the planes of their triangles, and
+* merge when they also share a dominant normal axis and a similar color. Triangles which collapse are dropped.
+* Writes the simplified shape with zero based indices and returns its triangle count.
+*/
+size_t DecimateShape(const ParaEngine::Vector3* vertices, const ParaEngine::Vector3* normals, const ParaEngine::Vector3* colors, size_t vertexCount,
+	const unsigned int* indices, size_t indexCount, float cellSize,
+	std::vector<ParaEngine::Vector3>& outVertices, std::vector<ParaEngine::Vector3>& outNormals, std::vector<ParaEngine::Vector3>& outColors, std::vector<unsigned int>& outIndices);
@@ -0,0 +1,92 @@
+#include "NplOSRenderPool.h"
+
+BufferPool::BufferPool(size_t maxRetained)
+	:m_nRetained(0), m_nMaxRetained(maxRetained)
+{
+}
+
+BufferPool::~BufferPool()
+{
+	for (auto& buffers : m_free)
+	{
+		for (auto buffer : buffers.second)
+			delete[] buffer;
+	}
+}
+
+size_t BufferPool::GetAllocationSize(size_t size)
+{
+	const size_t pageSize = 4096;
+	size_t bytes = 1;
+	while (bytes < size && bytes < pageSize)
+		bytes <<= 1;
+	if (bytes >= size)
+		return bytes;
+	// above a page: the power of two below size plus whole quarters of it
+	while (bytes * 2 < size)
+		bytes <<= 1;
+	size_t step = bytes / 4;
+	return bytes + (size - bytes + step - 1) / step * step;
+}
+
+unsigned char* BufferPool::Acquire(size_t size)
+{
+	size_t bytes = GetAllocationSize(size);
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
+		auto it = m_free.find(bytes);
+		if (it != m_free.end() && !it->second.empty())
+		{
+			unsigned char* buffer = it->second.back();
+			it->second.pop_back();
+			m_nRetained -= bytes;
+			return buffer;
+		}
+	}
+	return new unsigned char[bytes];
+}
+
+void BufferPool::Release(unsigned char* buffer, size_t size)
+{
+	if (buffer == nullptr)
+		return;
+	size_t bytes = GetAllocationSize(size);
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
+		if (m_nRetained + bytes <= m_nMaxRetained)
+		{
+			m_free[bytes].push_back(buffer);
+			m_nRetained += bytes;
+			return;
+		}
+	}
+	delete[] buffer;
+}
+
+void BufferPool::SetMaxRetained(size_t maxRetained)
+{
+	std::unique_lock<std::mutex> lk(m_mutex);
+	m_nMaxRetained = maxRetained;
+	Trim(maxRetained);
+}
+
+void BufferPool::TrimTo(size_t retained)
+{
+	std::unique_lock<std::mutex> lk(m_mutex);
+	Trim(retained);
+}
+
+void BufferPool::Trim(size_t maxRetained)
+{
+	// drop the largest buffers first, they are the least likely to be reused
+	for (auto it = m_free.rbegin(); it != m_free.rend() && m_nRetained > maxRetained; ++it)
+	{
+		std::vector<unsigned char*>& buffers = it->second;
+		while (!buffers.empty() && m_nRetained > maxRetained)
+		{
+			delete[] buffers.back();
+			buffers.pop_back();
+			m_nRetained -= it->first;
+		}
+	}
+}
@@ -0,0 +1,39 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <mutex>
+#include <cstddef>
+
+/**
+* pool of large byte buffers reused across jobs. Buffers are grouped in size classes, powers of two up to a page
+* and then four classes per doubling, so that jobs of similar size share them and a buffer is at most a quarter
+* larger than asked for; at most maxRetained bytes are kept while idle.
+*/
+class BufferPool
+{
+public:
+	explicit BufferPool(size_t maxRetained);
+	~BufferPool();
+
+	/** returns a buffer of at least size bytes */
+	unsigned char* Acquire(size_t size);
+	/** bytes really allocated for a buffer of size bytes */
+	static size_t GetAllocationSize(size_t size);
+	/** gives back a buffer from Acquire, size must be the size it was acquired with */
+	void Release(unsigned char* buffer, size_t size);
+	void SetMaxRetained(size_t maxRetained);
+	/** frees idle buffers until at most retained bytes are kept, without changing the limit */
+	void TrimTo(size_t retained);
+
+private:
+	BufferPool(const BufferPool&);
+	BufferPool& operator=(const BufferPool&);
+
+	void Trim(size_t maxRetained);
+
+	/** idle buffers by their allocation size */
+	std::map<size_t, std::vector<unsigned char*> > m_free;
+	size_t m_nRetained;
+	size_t m_nMaxRetained;
+	std::mutex m_mutex;
+};
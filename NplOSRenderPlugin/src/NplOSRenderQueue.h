@@ -0,0 +1,100 @@
+#pragma once
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+/** blocking FIFO between two pipeline stages. Producers wait while it is full, consumers while it is empty. */
+template <typename T>
+class BoundedQueue
+{
+public:
+	explicit BoundedQueue(size_t capacity = 1)
+		:m_capacity(capacity > 0 ? capacity : 1), m_closed(false) {}
+
+	void SetCapacity(size_t capacity)
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
+		m_capacity = capacity > 0 ? capacity : 1;
+		m_notFull.notify_all();
+	}
+
+	/** returns false if the queue was closed, the item is not queued then */
+	bool Push(const T& item)
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
+		while (!m_closed && m_items.size() >= m_capacity)
+			m_notFull.wait(lk);
+		if (m_closed)
+			return false;
+		m_items.push_back(item);
+		m_notEmpty.notify_one();
+		return true;
+	}
+
+	/** returns false once the queue is closed */
+	bool Pop(T& item)
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
+		while (!m_closed && m_items.empty())
+			m_notEmpty.wait(lk);
+		if (m_closed)
+			return false;
+		item = m_items.front();
+		m_items.pop_front();
+		m_notFull.notify_one();
+		return true;
+	}
+
+	/** like Pop, but also returns false when nothing arrives before until */
+	bool Pop(T& item, const std::chrono::steady_clock::time_point& until)
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
+		while (!m_closed && m_items.empty())
+		{
+			if (until == std::chrono::steady_clock::time_point::max())
+				m_notEmpty.wait(lk);
+			else if (m_notEmpty.wait_until(lk, until) == std::cv_status::timeout)
+				break;
+		}
+		if (m_closed || m_items.empty())
+			return false;
+		item = m_items.front();
+		m_items.pop_front();
+		m_notFull.notify_one();
+		return true;
+	}
+
+	bool IsClosed()
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
+		return m_closed;
+	}
+
+	/** wakes up all waiting producers and consumers */
+	void Close()
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
+		m_closed = true;
+		m_notEmpty.notify_all();
+		m_notFull.notify_all();
+	}
+
+	/** takes the items left in the queue, usually after Close() */
+	std::deque<T> Drain()
+	{
+		std::unique_lock<std::mutex> lk(m_mutex);
+		std::deque<T> items;
+		items.swap(m_items);
+		m_notFull.notify_all();
+		return items;
+	}
+
+private:
+	std::deque<T> m_items;
+	size_t m_capacity;
+	bool m_closed;
+	std::mutex m_mutex;
+	std::condition_variable m_notEmpty;
+	std::condition_variable m_notFull;
+};
@@ -0,0 +1,189 @@
+#include "NplOSRenderResample.h"
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NPLOSRENDER_SSE
+#include <emmintrin.h>
+#endif
+
+/** writes the pixel of the premultiplied channel sums r, g, b, a of count source pixels, with straight alpha if unpremultiply */
+static inline void ResolvePixel(const float sum[4], float count, bool unpremultiply, unsigned char* out)
+{
+	if (!unpremultiply)
+	{
+		for (int c = 0; c < 4; c++)
+			out[c] = (unsigned char)(sum[c] / count + 0.5f);
+		return;
+	}
+	if (sum[3] <= 0.0f)
+	{
+		out[0] = out[1] = out[2] = out[3] = 0;
+		return;
+	}
+	float scale = 255.0f / sum[3];
+	for (int c = 0; c < 3; c++)
+	{
+		float v = sum[c] * scale + 0.5f;
+		out[c] = (unsigned char)(v < 255.0f ? v : 255.0f);
+	}
+	out[3] = (unsigned char)(sum[3] / count + 0.5f);
+}
+
+/** box filter by whole factors kx and ky, over the whole sheet at once since cells stay aligned to the blocks */
+static void BoxDownsample(const unsigned char* src, size_t srcStride, unsigned char* dst, size_t dstStride, int dstWidth, int dstHeight, int kx, int ky, bool unpremultiply)
+{
+	// channel sums of ky source rows, kx * ky * 255 fits in 16 bits for the factors taken here
+	size_t rowBytes = (size_t)dstWidth * kx * 4;
+	std::vector<uint16_t> sums(rowBytes);
+	float count = (float)(kx * ky);
+	for (int y = 0; y < dstHeight; y++)
+	{
+		memset(&sums[0], 0, rowBytes * sizeof(uint16_t));
+		for (int r = 0; r < ky; r++)
+		{
+			const unsigned char* row = src + (size_t)(y * ky + r) * srcStride;
+			size_t i = 0;
+#ifdef NPLOSRENDER_SSE
+			const __m128i zero = _mm_setzero_si128();
+			for (; i + 16 <= rowBytes; i += 16)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*)(row + i));
+				__m128i* sum = (__m128i*)&sums[i];
+				_mm_storeu_si128(sum, _mm_add_epi16(_mm_loadu_si128(sum), _mm_unpacklo_epi8(v, zero)));
+				_mm_storeu_si128(sum + 1, _mm_add_epi16(_mm_loadu_si128(sum + 1), _mm_unpackhi_epi8(v, zero)));
+			}
+#endif
+			for (; i < rowBytes; i++)
+				sums[i] += row[i];
+		}
+
+		unsigned char* out = dst + (size_t)y * dstStride;
+		for (int x = 0; x < dstWidth; x++)
+		{
+			const uint16_t* block = &sums[(size_t)x * kx * 4];
+			float sum[4];
+#ifdef NPLOSRENDER_SSE
+			__m128i acc = _mm_setzero_si128();
+			for (int j = 0; j < kx; j++)
+				acc = _mm_add_epi16(acc, _mm_loadl_epi64((const __m128i*)(block + j * 4)));
+			_mm_storeu_ps(sum, _mm_cvtepi32_ps(_mm_unpacklo_epi16(acc, _mm_setzero_si128())));
+#else
+			unsigned int acc[4] = { 0, 0, 0, 0 };
+			for (int j = 0; j < kx; j++)
+			{
+				for (int c = 0; c < 4; c++)
+					acc[c] += block[j * 4 + c];
+			}
+			for (int c = 0; c < 4; c++)
+				sum[c] = (float)acc[c];
+#endif
+			ResolvePixel(sum, count, unpremultiply, out + x * 4);
+		}
+	}
+}
+
+/** source pixels covered by one output pixel, with the covered fraction of each */
+struct FilterSpan
+{
+	int first;
+	std::vector<float> weights;
+};
+
+static void ComputeSpans(int srcSize, int dstSize, std::vector<FilterSpan>& spans)
+{
+	double scale = (double)srcSize / dstSize;
+	spans.resize(dstSize);
+	for (int i = 0; i < dstSize; i++)
+	{
+		double begin = i * scale, end = (i + 1) * scale;
+		FilterSpan& span = spans[i];
+		span.first = (int)floor(begin);
+		span.weights.clear();
+		for (int s = span.first; s < end && s < srcSize; s++)
+			span.weights.push_back((float)(std::min(end, (double)s + 1) - std::max(begin, (double)s)));
+	}
+}
+
+/** area filter for any ratio, one cell at a time */
+static void AreaDownsample(const unsigned char* src, size_t srcStride, int srcWidth, int srcHeight, unsigned char* dst, size_t dstStride, int dstWidth, int dstHeight, bool unpremultiply)
+{
+	std::vector<FilterSpan> columns, rows;
+	ComputeSpans(srcWidth, dstWidth, columns);
+	ComputeSpans(srcHeight, dstHeight, rows);
+	float area = (float)((double)srcWidth / dstWidth * srcHeight / dstHeight);
+	std::vector<float> sums((size_t)dstWidth * 4);
+	for (int y = 0; y < dstHeight; y++)
+	{
+		std::fill(sums.begin(), sums.end(), 0.0f);
+		const FilterSpan& rowSpan = rows[y];
+		for (size_t r = 0; r < rowSpan.weights.size(); r++)
+		{
+			const unsigned char* row = src + (size_t)(rowSpan.first + r) * srcStride;
+			for (int x = 0; x < dstWidth; x++)
+			{
+				const FilterSpan& columnSpan = columns[x];
+				const unsigned char* pixel = row + (size_t)columnSpan.first * 4;
+				float* sum = &sums[(size_t)x * 4];
+				for (size_t c = 0; c < columnSpan.weights.size(); c++, pixel += 4)
+				{
+					float w = columnSpan.weights[c] * rowSpan.weights[r];
+					sum[0] += pixel[0] * w;
+					sum[1] += pixel[1] * w;
+					sum[2] += pixel[2] * w;
+					sum[3] += pixel[3] * w;
+				}
+			}
+		}
+		for (int x = 0; x < dstWidth; x++)
+			ResolvePixel(&sums[(size_t)x * 4], area, unpremultiply, dst + (size_t)y * dstStride + x * 4);
+	}
+}
+
+/** the whole factors of a ratio the box filter takes, false for other ratios */
+static bool GetBoxFactors(int srcWidth, int srcHeight, int dstWidth, int dstHeight, int& kx, int& ky)
+{
+	if (srcWidth % dstWidth != 0 || srcHeight % dstHeight != 0)
+		return false;
+	kx = srcWidth / dstWidth;
+	ky = srcHeight / dstHeight;
+	return kx * ky * 255 <= 65535;
+}
+
+void DownsampleSheet(const unsigned char* src, int srcWidth, int srcHeight, unsigned char* dst, int dstWidth, int dstHeight, int frames, bool unpremultiply)
+{
+	size_t srcStride = (size_t)srcWidth * frames * 4;
+	size_t dstStride = (size_t)dstWidth * frames * 4;
+	int kx, ky;
+	if (GetBoxFactors(srcWidth, srcHeight, dstWidth, dstHeight, kx, ky))
+	{
+		BoxDownsample(src, srcStride, dst, dstStride, dstWidth * frames, dstHeight, kx, ky, unpremultiply);
+		return;
+	}
+	for (int f = 0; f < frames; f++)
+		AreaDownsample(src + (size_t)f * srcWidth * 4, srcStride, srcWidth, srcHeight, dst + (size_t)f * dstWidth * 4, dstStride, dstWidth, dstHeight, unpremultiply);
+}
+
+void DownsampleFrame(const unsigned char* src, size_t srcStride, int srcWidth, int srcHeight, unsigned char* dst, size_t dstStride, int dstWidth, int dstHeight, bool unpremultiply)
+{
+	int kx, ky;
+	if (GetBoxFactors(srcWidth, srcHeight, dstWidth, dstHeight, kx, ky))
+		BoxDownsample(src, srcStride, dst, dstStride, dstWidth, dstHeight, kx, ky, unpremultiply);
+	else
+		AreaDownsample(src, srcStride, srcWidth, srcHeight, dst, dstStride, dstWidth, dstHeight, unpremultiply);
+}
+
+void UnpremultiplyPixels(unsigned char* pixels, size_t count)
+{
+	for (size_t i = 0; i < count; i++, pixels += 4)
+	{
+		// opaque and empty pixels, nearly all of them, stay as they are
+		int alpha = pixels[3];
+		if (alpha == 0 || alpha == 255)
+			continue;
+		for (int c = 0; c < 3; c++)
+			pixels[c] = (unsigned char)std::min(255, (pixels[c] * 255 + alpha / 2) / alpha);
+	}
+}
@@ -0,0 +1,18 @@
+#pragma once
+#include <cstddef>
+
+/**
+* shrinks a sprite sheet of frames cells of srcWidth x srcHeight RGBA pixels into cells of dstWidth x dstHeight with a
+* box filter, each output pixel is the area weighted average of the source pixels it covers. Rows are frames cells wide.
+* The rendered sheet is drawn over transparent black, so its colors are premultiplied by alpha: they are averaged as they
+* are and, if unpremultiply, divided by the average alpha afterwards, so that the background does not darken edge pixels.
+* Otherwise the output stays premultiplied, to be filtered again.
+* Whole ratios take an SSE2 path while at most 257 source pixels fall on one output pixel, other ratios a scalar one.
+*/
+void DownsampleSheet(const unsigned char* src, int srcWidth, int srcHeight, unsigned char* dst, int dstWidth, int dstHeight, int frames, bool unpremultiply);
+
+/** filters a single frame down the same way, src and dst rows are srcStride and dstStride bytes apart */
+void DownsampleFrame(const unsigned char* src, size_t srcStride, int srcWidth, int srcHeight, unsigned char* dst, size_t dstStride, int dstWidth, int dstHeight, bool unpremultiply);
+
+/** turns count premultiplied RGBA pixels drawn over transparent black into straight alpha, in place */
+void UnpremultiplyPixels(unsigned char* pixels, size_t count);
@@ -0,0 +1,378 @@
+#include "NplOSRenderShader.h"
+#include <cstdio>
+#include <cmath>
+
+using namespace ParaEngine;
+
+// generic attribute locations, the world matrix of an instance takes four of them
+enum { PositionAttrib = 0, NormalAttrib = 1, ColorAttrib = 2, WorldAttrib = 3 };
+
+/**
+* positions are transformed per vertex, lighting is done per pixel with the light of InitLights: a positional light at
+* (17, 30, 9) in eye space with ambient 0x444444, white diffuse and specular, and the default global ambient of 0.2.
+* The normal matrix is the cofactor matrix of the model view, which is the inverse transpose up to a scale.
+* The frames of a turntable are drawn as instances: each one is spun by its own angle around z and moved into its own
+* tile of the viewport, and clipped to that tile.
+*/
+static const char* s_vertexShader =
+	"#version 330\n"
+	"uniform mat4 projection;\n"
+	"uniform mat4 tilt;\n"
+	"uniform vec3 center;\n"
+	"uniform float step;\n"
+	"uniform int firstFrame;\n"
+	"uniform int tiles;\n"
+	"in vec3 position;\n"
+	"in vec3 normal;\n"
+	"in vec3 color;\n"
+	"in mat4 world;\n"
+	"out vec3 eyePosition;\n"
+	"out vec3 eyeNormal;\n"
+	"out vec3 surfaceColor;\n"
+	"void main()\n"
+	"{\n"
+	"	int tile = gl_InstanceID % tiles;\n"
+	"	float angle = step * float(firstFrame + tile);\n"
+	"	float c = cos(angle);\n"
+	"	float s = sin(angle);\n"
+	"	mat4 view = tilt * mat4(c, s, 0.0, 0.0, -s, c, 0.0, 0.0, 0.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 1.0);\n"
+	"	vec4 model = world * vec4(position, 1.0);\n"
+	"	vec4 eye = view * vec4(model.xyz - center * model.w, model.w);\n"
+	"	mat3 m = mat3(view) * mat3(world);\n"
+	"	mat3 cofactor = mat3(cross(m[1], m[2]), cross(m[2], m[0]), cross(m[0], m[1]));\n"
+	"	eyeNormal = cofactor * normal * sign(dot(m[0], cofactor[0]));\n"
+	"	eyePosition = eye.xyz;\n"
+	"	surfaceColor = color;\n"
+	"	vec4 clip = projection * eye;\n"
+	"	gl_ClipDistance[0] = clip.w + clip.x;\n"
+	"	gl_ClipDistance[1] = clip.w - clip.x;\n"
+	"	clip.x = (clip.x + clip.w * float(2 * tile + 1)) / float(tiles) - clip.w;\n"
+	"	gl_Position = clip;\n"
+	"}\n";
+
+static const char* s_fragmentShader =
+	"#version 330\n"
+	"in vec3 eyePosition;\n"
+	"in vec3 eyeNormal;\n"
+	"in vec3 surfaceColor;\n"
+	"out vec4 fragColor;\n"
+	"void main()\n"
+	"{\n"
+	"	vec3 n = normalize(eyeNormal);\n"
+	"	vec3 l = normalize(vec3(17.0, 30.0, 9.0) - eyePosition);\n"
+	"	float diffuse = max(dot(n, l), 0.0);\n"
+	"	float specular = diffuse > 0.0 ? pow(max(dot(n, normalize(l + vec3(0.0, 0.0, 1.0))), 0.0), 100.0) : 0.0;\n"
+	"	vec3 color = surfaceColor * (0.2 + 68.0 / 255.0 + diffuse) + vec3(specular);\n"
+	"	fragColor = vec4(min(color, vec3(1.0)), 1.0);\n"
+	"}\n";
+
+const ShaderAPI* ShaderAPI::Get()
+{
+	static ShaderAPI api;
+	static bool loaded = [] {
+		bool ok = true;
+#define LOAD_GL(name) ok = (api.name = (decltype(api.name))OSMesaGetProcAddress("gl" #name)) != nullptr && ok
+		LOAD_GL(CreateShader);
+		LOAD_GL(ShaderSource);
+		LOAD_GL(CompileShader);
+		LOAD_GL(GetShaderiv);
+		LOAD_GL(GetShaderInfoLog);
+		LOAD_GL(DeleteShader);
+		LOAD_GL(CreateProgram);
+		LOAD_GL(AttachShader);
+		LOAD_GL(BindAttribLocation);
+		LOAD_GL(LinkProgram);
+		LOAD_GL(GetProgramiv);
+		LOAD_GL(GetProgramInfoLog);
+		LOAD_GL(DeleteProgram);
+		LOAD_GL(UseProgram);
+		LOAD_GL(GetUniformLocation);
+		LOAD_GL(UniformMatrix4fv);
+		LOAD_GL(Uniform3f);
+		LOAD_GL(Uniform1f);
+		LOAD_GL(Uniform1i);
+		LOAD_GL(GenBuffers);
+		LOAD_GL(BindBuffer);
+		LOAD_GL(BufferData);
+		LOAD_GL(DeleteBuffers);
+		LOAD_GL(GenVertexArrays);
+		LOAD_GL(BindVertexArray);
+		LOAD_GL(DeleteVertexArrays);
+		LOAD_GL(EnableVertexAttribArray);
+		LOAD_GL(VertexAttribPointer);
+		LOAD_GL(VertexAttribDivisor);
+		LOAD_GL(VertexAttrib3f);
+		LOAD_GL(DrawElementsInstanced);
+#undef LOAD_GL
+		return ok;
+	}();
+	return loaded ? &api : nullptr;
+}
+
+/**
+* same as CompileShaderText of osmesa/util/shaderutil.c, which cannot be linked into the plugin: it resolves its
+* entry points through GLEW and calls exit(1) on errors. Returns 0 on failure instead.
+*/
+static GLuint CompileShaderText(const ShaderAPI& gl, GLenum shaderType, const char* text)
+{
+	GLuint shader = gl.CreateShader(shaderType);
+	gl.ShaderSource(shader, 1, &text, nullptr);
+	gl.CompileShader(shader);
+	GLint stat = 0;
+	gl.GetShaderiv(shader, GL_COMPILE_STATUS, &stat);
+	if (!stat)
+	{
+		GLchar log[1000];
+		GLsizei len = 0;
+		gl.GetShaderInfoLog(shader, sizeof(log), &len, log);
+		printf("shader compile failed: %s\n", log);
+		gl.DeleteShader(shader);
+		return 0;
+	}
+	return shader;
+}
+
+/** same as LinkShaders of shaderutil.c, with the attribute locations bound before linking */
+static GLuint LinkShaders(const ShaderAPI& gl, GLuint vertShader, GLuint fragShader)
+{
+	GLuint program = gl.CreateProgram();
+	gl.AttachShader(program, vertShader);
+	gl.AttachShader(program, fragShader);
+	gl.BindAttribLocation(program, PositionAttrib, "position");
+	gl.BindAttribLocation(program, NormalAttrib, "normal");
+	gl.BindAttribLocation(program, ColorAttrib, "color");
+	gl.BindAttribLocation(program, WorldAttrib, "world");
+	gl.LinkProgram(program);
+	GLint stat = 0;
+	gl.GetProgramiv(program, GL_LINK_STATUS, &stat);
+	if (!stat)
+	{
+		GLchar log[1000];
+		GLsizei len = 0;
+		gl.GetProgramInfoLog(program, sizeof(log), &len, log);
+		printf("shader link failed: %s\n", log);
+		gl.DeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+ShaderProgram::ShaderProgram()
+	:m_program(0), m_projection(-1), m_tilt(-1), m_center(-1), m_step(-1), m_firstFrame(-1), m_tiles(-1)
+{
+}
+
+bool ShaderProgram::Create()
+{
+	const ShaderAPI* gl = ShaderAPI::Get();
+	if (gl == nullptr)
+		return false;
+	GLuint vertShader = CompileShaderText(*gl, GL_VERTEX_SHADER, s_vertexShader);
+	GLuint fragShader = CompileShaderText(*gl, GL_FRAGMENT_SHADER, s_fragmentShader);
+	if (vertShader != 0 && fragShader != 0)
+		m_program = LinkShaders(*gl, vertShader, fragShader);
+	// the program keeps the compiled shaders alive as long as it needs them
+	if (vertShader != 0)
+		gl->DeleteShader(vertShader);
+	if (fragShader != 0)
+		gl->DeleteShader(fragShader);
+	if (m_program == 0)
+		return false;
+	m_projection = gl->GetUniformLocation(m_program, "projection");
+	m_tilt = gl->GetUniformLocation(m_program, "tilt");
+	m_center = gl->GetUniformLocation(m_program, "center");
+	m_step = gl->GetUniformLocation(m_program, "step");
+	m_firstFrame = gl->GetUniformLocation(m_program, "firstFrame");
+	m_tiles = gl->GetUniformLocation(m_program, "tiles");
+	return true;
+}
+
+void ShaderProgram::Destroy()
+{
+	if (m_program != 0)
+		ShaderAPI::Get()->DeleteProgram(m_program);
+	m_program = 0;
+}
+
+void ShaderProgram::Use()
+{
+	ShaderAPI::Get()->UseProgram(m_program);
+}
+
+void ShaderProgram::SetProjection(int w, int h, float scale)
+{
+	float x = scale, y = scale;
+	if (w <= h)
+		y = scale * (float)h / (float)w;
+	else
+		x = scale * (float)w / (float)h;
+	// glOrtho(-x, x, y, -y, -scale, scale), column major
+	const float projection[16] = {
+		1.0f / x, 0, 0, 0,
+		0, -1.0f / y, 0, 0,
+		0, 0, -1.0f / scale, 0,
+		0, 0, 0, 1 };
+	ShaderAPI::Get()->UniformMatrix4fv(m_projection, 1, GL_FALSE, projection);
+}
+
+void ShaderProgram::SetTurntable(float angleX, float stepZ, const Vector3& center)
+{
+	const float toRadian = 3.14159265358979f / 180.0f;
+	float c = cosf(angleX * toRadian), s = sinf(angleX * toRadian);
+	// rotate(angleX, 1, 0, 0), column major
+	const float tilt[16] = {
+		1, 0, 0, 0,
+		0, c, s, 0,
+		0, -s, c, 0,
+		0, 0, 0, 1 };
+	const ShaderAPI& gl = *ShaderAPI::Get();
+	gl.UniformMatrix4fv(m_tilt, 1, GL_FALSE, tilt);
+	gl.Uniform3f(m_center, center.x, center.y, center.z);
+	gl.Uniform1f(m_step, stepZ * toRadian);
+}
+
+void ShaderProgram::SetFrames(int firstFrame, int tiles)
+{
+	const ShaderAPI& gl = *ShaderAPI::Get();
+	gl.Uniform1i(m_firstFrame, firstFrame);
+	gl.Uniform1i(m_tiles, tiles);
+}
+
+void MeshBuffers::AddPart(const float* vertices, const float* normals, const float* colors, size_t vertexCount,
+	const unsigned int* indices, size_t indexCount, const float* worlds, size_t instanceCount)
+{
+	const ShaderAPI& gl = *ShaderAPI::Get();
+	auto createBuffer = [&gl](GLenum target, const void* data, size_t size) {
+		GLuint buffer = 0;
+		gl.GenBuffers(1, &buffer);
+		gl.BindBuffer(target, buffer);
+		gl.BufferData(target, size, data, GL_STATIC_DRAW);
+		return buffer;
+	};
+	Part part;
+	part.vertexBuffer = createBuffer(GL_ARRAY_BUFFER, vertices, vertexCount * 3 * sizeof(float));
+	if (normals != nullptr)
+		part.normalBuffer = createBuffer(GL_ARRAY_BUFFER, normals, vertexCount * 3 * sizeof(float));
+	if (colors != nullptr)
+		part.colorBuffer = createBuffer(GL_ARRAY_BUFFER, colors, vertexCount * 3 * sizeof(float));
+	part.instanceBuffer = createBuffer(GL_ARRAY_BUFFER, worlds, instanceCount * 16 * sizeof(float));
+	gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+	part.indexBuffer = createBuffer(GL_ELEMENT_ARRAY_BUFFER, indices, indexCount * sizeof(unsigned int));
+	gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	part.instanceCount = (GLsizei)instanceCount;
+	part.ranges.push_back(std::make_pair((size_t)0, indexCount));
+	m_parts.push_back(part);
+}
+
+void MeshBuffers::Upload(const MeshData& mesh)
+{
+	static const Matrix4 identity(1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1);
+	if (!mesh.indexBuffer.empty())
+	{
+		// shapes given without normals or colors leave these buffers short, they are then drawn with constant values
+		size_t vertexCount = mesh.vertexBuffer.size();
+		const float* normals = mesh.normalBuffer.size() == vertexCount ? &mesh.normalBuffer[0].x : nullptr;
+		const float* colors = mesh.colorBuffer.size() == vertexCount ? &mesh.colorBuffer[0].x : nullptr;
+		AddPart(&mesh.vertexBuffer[0].x, normals, colors, vertexCount,
+			&mesh.indexBuffer[0], mesh.indexBuffer.size(), identity._m, 1);
+		m_parts.back().ranges.clear();
+		mesh.GetDrawRanges(m_parts.back().ranges);
+	}
+	for (auto& shape : mesh.mappedShapes)
+		AddPart(shape.vertices, shape.normals, shape.colors, shape.vertexCount, shape.indices, shape.indexCount, shape.world._m, 1);
+
+	// every instanced mesh is one part, drawn with one instanced call per range
+	std::vector<float> worlds;
+	for (size_t i = 0; i < mesh.instancedMeshes.size(); i++)
+	{
+		const InstancedMesh& shared = mesh.instancedMeshes[i];
+		worlds.clear();
+		for (auto& instance : mesh.instances)
+		{
+			if (instance.mesh == (int)i)
+				worlds.insert(worlds.end(), instance.world._m, instance.world._m + 16);
+		}
+		if (worlds.empty() || shared.indexBuffer.empty())
+			continue;
+		size_t vertexCount = shared.vertexBuffer.size();
+		const float* normals = shared.normalBuffer.size() == vertexCount ? &shared.normalBuffer[0].x : nullptr;
+		const float* colors = shared.colorBuffer.size() == vertexCount ? &shared.colorBuffer[0].x : nullptr;
+		AddPart(&shared.vertexBuffer[0].x, normals, colors, vertexCount,
+			&shared.indexBuffer[0], shared.indexBuffer.size(), &worlds[0], worlds.size() / 16);
+	}
+}
+
+void MeshBuffers::Release()
+{
+	if (m_parts.empty())
+		return;
+	const ShaderAPI& gl = *ShaderAPI::Get();
+	for (auto& part : m_parts)
+	{
+		GLuint buffers[5] = { part.vertexBuffer, part.normalBuffer, part.colorBuffer, part.indexBuffer, part.instanceBuffer };
+		gl.DeleteBuffers(5, buffers);
+	}
+	m_parts.clear();
+}
+
+void MeshBuffers::CreateVertexArrays(std::vector<GLuint>& vertexArrays, int tiles) const
+{
+	const ShaderAPI& gl = *ShaderAPI::Get();
+	vertexArrays.resize(m_parts.size());
+	if (m_parts.empty())
+		return;
+	gl.GenVertexArrays((GLsizei)vertexArrays.size(), &vertexArrays[0]);
+	for (size_t i = 0; i < m_parts.size(); i++)
+	{
+		const Part& part = m_parts[i];
+		gl.BindVertexArray(vertexArrays[i]);
+		auto bindAttrib = [&gl](GLuint index, GLuint buffer) {
+			if (buffer == 0)
+				return;
+			gl.BindBuffer(GL_ARRAY_BUFFER, buffer);
+			gl.EnableVertexAttribArray(index);
+			gl.VertexAttribPointer(index, 3, GL_FLOAT, GL_FALSE, 0, nullptr);
+		};
+		bindAttrib(PositionAttrib, part.vertexBuffer);
+		bindAttrib(NormalAttrib, part.normalBuffer);
+		bindAttrib(ColorAttrib, part.colorBuffer);
+		gl.BindBuffer(GL_ARRAY_BUFFER, part.instanceBuffer);
+		for (GLuint column = 0; column < 4; column++)
+		{
+			gl.EnableVertexAttribArray(WorldAttrib + column);
+			gl.VertexAttribPointer(WorldAttrib + column, 4, GL_FLOAT, GL_FALSE, 16 * sizeof(float), (const void*)(column * 4 * sizeof(float)));
+			gl.VertexAttribDivisor(WorldAttrib + column, tiles);
+		}
+		gl.BindBuffer(GL_ELEMENT_ARRAY_BUFFER, part.indexBuffer);
+	}
+	gl.BindVertexArray(0);
+	gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void MeshBuffers::DeleteVertexArrays(std::vector<GLuint>& vertexArrays) const
+{
+	if (!vertexArrays.empty())
+		ShaderAPI::Get()->DeleteVertexArrays((GLsizei)vertexArrays.size(), &vertexArrays[0]);
+	vertexArrays.clear();
+}
+
+void MeshBuffers::Draw(const std::vector<GLuint>& vertexArrays, int tiles) const
+{
+	const ShaderAPI& gl = *ShaderAPI::Get();
+	for (size_t i = 0; i < m_parts.size(); i++)
+	{
+		const Part& part = m_parts[i];
+		gl.BindVertexArray(vertexArrays[i]);
+		// parts without normals or colors take these constant values
+		if (part.normalBuffer == 0)
+			gl.VertexAttrib3f(NormalAttrib, 0, 0, 1);
+		if (part.colorBuffer == 0)
+			gl.VertexAttrib3f(ColorAttrib, 1, 1, 1);
+		for (auto& range : part.ranges)
+		{
+			gl.DrawElementsInstanced(GL_TRIANGLES, (GLsizei)range.second, GL_UNSIGNED_INT,
+				(const void*)(range.first * sizeof(unsigned int)), part.instanceCount * tiles);
+		}
+	}
+	gl.BindVertexArray(0);
+}
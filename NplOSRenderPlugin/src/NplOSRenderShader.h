@@ -0,0 +1,117 @@
+#pragma once
+#include "GL/osmesa.h"
+#include "gl_wrap.h"
+#include "NplOSRenderMesh.h"
+#include <vector>
+#include <utility>
+
+/** GL 2.0 to 3.3 entry points of the shader path, resolved with OSMesaGetProcAddress like the other post 1.1 calls */
+struct ShaderAPI
+{
+	PFNGLCREATESHADERPROC CreateShader;
+	PFNGLSHADERSOURCEPROC ShaderSource;
+	PFNGLCOMPILESHADERPROC CompileShader;
+	PFNGLGETSHADERIVPROC GetShaderiv;
+	PFNGLGETSHADERINFOLOGPROC GetShaderInfoLog;
+	PFNGLDELETESHADERPROC DeleteShader;
+	PFNGLCREATEPROGRAMPROC CreateProgram;
+	PFNGLATTACHSHADERPROC AttachShader;
+	PFNGLBINDATTRIBLOCATIONPROC BindAttribLocation;
+	PFNGLLINKPROGRAMPROC LinkProgram;
+	PFNGLGETPROGRAMIVPROC GetProgramiv;
+	PFNGLGETPROGRAMINFOLOGPROC GetProgramInfoLog;
+	PFNGLDELETEPROGRAMPROC DeleteProgram;
+	PFNGLUSEPROGRAMPROC UseProgram;
+	PFNGLGETUNIFORMLOCATIONPROC GetUniformLocation;
+	PFNGLUNIFORMMATRIX4FVPROC UniformMatrix4fv;
+	PFNGLUNIFORM3FPROC Uniform3f;
+	PFNGLUNIFORM1FPROC Uniform1f;
+	PFNGLUNIFORM1IPROC Uniform1i;
+	PFNGLGENBUFFERSPROC GenBuffers;
+	PFNGLBINDBUFFERPROC BindBuffer;
+	PFNGLBUFFERDATAPROC BufferData;
+	PFNGLDELETEBUFFERSPROC DeleteBuffers;
+	PFNGLGENVERTEXARRAYSPROC GenVertexArrays;
+	PFNGLBINDVERTEXARRAYPROC BindVertexArray;
+	PFNGLDELETEVERTEXARRAYSPROC DeleteVertexArrays;
+	PFNGLENABLEVERTEXATTRIBARRAYPROC EnableVertexAttribArray;
+	PFNGLVERTEXATTRIBPOINTERPROC VertexAttribPointer;
+	PFNGLVERTEXATTRIBDIVISORPROC VertexAttribDivisor;
+	PFNGLVERTEXATTRIB3FPROC VertexAttrib3f;
+	PFNGLDRAWELEMENTSINSTANCEDPROC DrawElementsInstanced;
+
+	/** resolves all entry points on first use, returns nullptr if any of them is missing */
+	static const ShaderAPI* Get();
+};
+
+/** the Phong program of one worker. Uniforms are program state, so workers do not share programs */
+class ShaderProgram
+{
+public:
+	ShaderProgram();
+
+	/** compiles and links the program in the current context, prints the log and returns false on failure */
+	bool Create();
+	void Destroy();
+	bool IsValid() const { return m_program != 0; }
+	void Use();
+	/** the same orthographic view as NplOSRender::ResizeView */
+	void SetProjection(int w, int h, float scale);
+	/** frame i shows the model with center at the origin, turned by i * stepZ degrees around z and then by angleX around x */
+	void SetTurntable(float angleX, float stepZ, const ParaEngine::Vector3& center);
+	/** the next draw renders frames firstFrame to firstFrame + tiles - 1, side by side in the viewport */
+	void SetFrames(int firstFrame, int tiles);
+
+private:
+	ShaderProgram(const ShaderProgram&);
+	ShaderProgram& operator=(const ShaderProgram&);
+
+	GLuint m_program;
+	GLint m_projection;
+	GLint m_tilt;
+	GLint m_center;
+	GLint m_step;
+	GLint m_firstFrame;
+	GLint m_tiles;
+};
+
+/**
+* vertex and index buffers of a job, uploaded once by the worker that starts the job. Buffers are shared by all contexts,
+* while vertex array objects are not, so every worker drawing the job creates its own.
+*/
+class MeshBuffers
+{
+public:
+	MeshBuffers() {}
+
+	/** uploads the shapes, mapped shapes and instanced meshes of a built mesh, a context of the share group must be current */
+	void Upload(const MeshData& mesh);
+	/** deletes the buffers, a context of the share group must be current */
+	void Release();
+	/** tiles is the number of frames drawn by one call, each instance is repeated for every frame */
+	void CreateVertexArrays(std::vector<GLuint>& vertexArrays, int tiles) const;
+	void DeleteVertexArrays(std::vector<GLuint>& vertexArrays) const;
+	/** draws all parts with the current program, using the vertex arrays of CreateVertexArrays */
+	void Draw(const std::vector<GLuint>& vertexArrays, int tiles) const;
+
+private:
+	MeshBuffers(const MeshBuffers&);
+	MeshBuffers& operator=(const MeshBuffers&);
+
+	/** geometry drawn with one set of buffers, once per world matrix of its instance buffer */
+	struct Part
+	{
+		GLuint vertexBuffer = 0;
+		GLuint normalBuffer = 0;
+		GLuint colorBuffer = 0;
+		GLuint indexBuffer = 0;
+		GLuint instanceBuffer = 0;
+		GLsizei instanceCount = 0;
+		/** (first index, index count) of each draw call */
+		std::vector<std::pair<size_t, size_t> > ranges;
+	};
+	void AddPart(const float* vertices, const float* normals, const float* colors, size_t vertexCount,
+		const unsigned int* indices, size_t indexCount, const float* worlds, size_t instanceCount);
+
+	std::vector<Part> m_parts;
+};
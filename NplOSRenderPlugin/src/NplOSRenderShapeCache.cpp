@@ -0,0 +1,68 @@
+#include "NplOSRenderShapeCache.h"
+
+using namespace ParaEngine;
+
+ShapeCache::ShapeCache(size_t maxBytes)
+	:m_nBytes(0), m_nMaxBytes(maxBytes)
+{
+}
+
+bool ShapeCache::Append(unsigned long long key, MeshData& mesh, Vector3& vmin, Vector3& vmax)
+{
+	std::unique_lock<std::mutex> lk(m_mutex);
+	auto it = m_entries.find(key);
+	if (it == m_entries.end())
+		return false;
+	Entry& entry = it->second;
+	m_lru.splice(m_lru.begin(), m_lru, entry.lru);
+
+	unsigned int firstVertex = (unsigned int)mesh.vertexBuffer.size();
+	mesh.vertexBuffer.insert(mesh.vertexBuffer.end(), entry.vertices.begin(), entry.vertices.end());
+	mesh.normalBuffer.insert(mesh.normalBuffer.end(), entry.normals.begin(), entry.normals.end());
+	mesh.colorBuffer.insert(mesh.colorBuffer.end(), entry.colors.begin(), entry.colors.end());
+	size_t firstIndex = mesh.indexBuffer.size();
+	mesh.indexBuffer.resize(firstIndex + entry.indices.size());
+	for (size_t i = 0; i < entry.indices.size(); i++)
+		mesh.indexBuffer[firstIndex + i] = entry.indices[i] + firstVertex;
+
+	if (entry.vmax.x > vmax.x) vmax.x = entry.vmax.x;	if (entry.vmin.x < vmin.x) vmin.x = entry.vmin.x;
+	if (entry.vmax.y > vmax.y) vmax.y = entry.vmax.y;	if (entry.vmin.y < vmin.y) vmin.y = entry.vmin.y;
+	if (entry.vmax.z > vmax.z) vmax.z = entry.vmax.z;	if (entry.vmin.z < vmin.z) vmin.z = entry.vmin.z;
+	return true;
+}
+
+void ShapeCache::Insert(unsigned long long key, const MeshData& mesh, size_t firstVertex, size_t firstIndex, const Vector3& vmin, const Vector3& vmax)
+{
+	if (mesh.normalBuffer.size() != mesh.vertexBuffer.size() || mesh.colorBuffer.size() != mesh.vertexBuffer.size())
+		return;
+	size_t vertexCount = mesh.vertexBuffer.size() - firstVertex;
+	size_t indexCount = mesh.indexBuffer.size() - firstIndex;
+	size_t bytes = (vertexCount * 3) * sizeof(Vector3) + indexCount * sizeof(unsigned int);
+	if (bytes > m_nMaxBytes / 4)
+		return;
+
+	std::unique_lock<std::mutex> lk(m_mutex);
+	if (m_entries.find(key) != m_entries.end())
+		return;
+	while (m_nBytes + bytes > m_nMaxBytes && !m_lru.empty())
+	{
+		auto oldest = m_entries.find(m_lru.back());
+		m_nBytes -= oldest->second.bytes;
+		m_entries.erase(oldest);
+		m_lru.pop_back();
+	}
+
+	Entry& entry = m_entries[key];
+	entry.vertices.assign(mesh.vertexBuffer.begin() + firstVertex, mesh.vertexBuffer.end());
+	entry.normals.assign(mesh.normalBuffer.begin() + firstVertex, mesh.normalBuffer.end());
+	entry.colors.assign(mesh.colorBuffer.begin() + firstVertex, mesh.colorBuffer.end());
+	entry.indices.resize(indexCount);
+	for (size_t i = 0; i < indexCount; i++)
+		entry.indices[i] = mesh.indexBuffer[firstIndex + i] - (unsigned int)firstVertex;
+	entry.vmin = vmin;
+	entry.vmax = vmax;
+	entry.bytes = bytes;
+	m_lru.push_front(key);
+	entry.lru = m_lru.begin();
+	m_nBytes += bytes;
+}
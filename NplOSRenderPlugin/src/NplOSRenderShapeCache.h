@@ -0,0 +1,41 @@
+#pragma once
+#include "NplOSRenderMesh.h"
+#include <list>
+#include <map>
+#include <mutex>
+
+/**
+* least recently used cache of processed shapes, keyed by a hash of the shape's render list entry and the
+* processing options. Lets repeated requests for the same model skip parsing and mesh optimization.
+*/
+class ShapeCache
+{
+public:
+	explicit ShapeCache(size_t maxBytes);
+
+	/** appends the cached shape to mesh and grows vmin/vmax by its bounds, returns false if it is not cached */
+	bool Append(unsigned long long key, MeshData& mesh, ParaEngine::Vector3& vmin, ParaEngine::Vector3& vmax);
+	/** stores the shape built into mesh at firstVertex/firstIndex, with its bounds */
+	void Insert(unsigned long long key, const MeshData& mesh, size_t firstVertex, size_t firstIndex, const ParaEngine::Vector3& vmin, const ParaEngine::Vector3& vmax);
+
+private:
+	struct Entry
+	{
+		std::vector<ParaEngine::Vector3> vertices;
+		std::vector<ParaEngine::Vector3> normals;
+		std::vector<ParaEngine::Vector3> colors;
+		/** zero based */
+		std::vector<unsigned int> indices;
+		ParaEngine::Vector3 vmin;
+		ParaEngine::Vector3 vmax;
+		size_t bytes;
+		std::list<unsigned long long>::iterator lru;
+	};
+
+	std::map<unsigned long long, Entry> m_entries;
+	/** most recently used first */
+	std::list<unsigned long long> m_lru;
+	size_t m_nBytes;
+	size_t m_nMaxBytes;
+	std::mutex m_mutex;
+};
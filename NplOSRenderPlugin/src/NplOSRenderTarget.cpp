@@ -0,0 +1,85 @@
+#include "NplOSRenderTarget.h"
+#include <cstdio>
+#include <cstddef>
+
+const FramebufferAPI* FramebufferAPI::Get()
+{
+	static FramebufferAPI api;
+	static bool loaded = [] {
+		bool ok = true;
+#define LOAD_GL(name) ok = (api.name = (decltype(api.name))OSMesaGetProcAddress("gl" #name)) != nullptr && ok
+		LOAD_GL(GenFramebuffers);
+		LOAD_GL(BindFramebuffer);
+		LOAD_GL(DeleteFramebuffers);
+		LOAD_GL(FramebufferRenderbuffer);
+		LOAD_GL(CheckFramebufferStatus);
+		LOAD_GL(GenRenderbuffers);
+		LOAD_GL(BindRenderbuffer);
+		LOAD_GL(RenderbufferStorage);
+		LOAD_GL(DeleteRenderbuffers);
+#undef LOAD_GL
+		return ok;
+	}();
+	return loaded ? &api : nullptr;
+}
+
+RenderTarget::RenderTarget()
+	:m_framebuffer(0), m_color(0), m_depth(0), m_width(0), m_height(0)
+{
+}
+
+bool RenderTarget::Bind(int width, int height)
+{
+	const FramebufferAPI* api = FramebufferAPI::Get();
+	if (api == nullptr)
+		return false;
+	if (m_framebuffer == 0)
+	{
+		api->GenFramebuffers(1, &m_framebuffer);
+		api->GenRenderbuffers(1, &m_color);
+		api->GenRenderbuffers(1, &m_depth);
+	}
+	api->BindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+	// kept across jobs of the same size or smaller, reallocated when a job needs more or only a small part of it
+	if (width > m_width || height > m_height || (size_t)m_width * m_height > (size_t)width * height * 4)
+	{
+		api->BindRenderbuffer(GL_RENDERBUFFER, m_color);
+		api->RenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+		api->BindRenderbuffer(GL_RENDERBUFFER, m_depth);
+		api->RenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
+		api->BindRenderbuffer(GL_RENDERBUFFER, 0);
+		api->FramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_color);
+		api->FramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_depth);
+		api->FramebufferRenderbuffer(GL_FRAMEBUFFER, GL_STENCIL_ATTACHMENT, GL_RENDERBUFFER, m_depth);
+		m_width = width;
+		m_height = height;
+		if (api->CheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			printf("framebuffer of %dx%d pixels is incomplete\n", width, height);
+			m_width = m_height = 0;
+			return false;
+		}
+	}
+	return true;
+}
+
+void RenderTarget::Read(int x, int width, int height, unsigned char* dst, int rowLength)
+{
+	glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	glPixelStorei(GL_PACK_ROW_LENGTH, rowLength);
+	glReadPixels(x, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, dst);
+	glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+}
+
+void RenderTarget::Destroy()
+{
+	const FramebufferAPI* api = FramebufferAPI::Get();
+	if (api != nullptr && m_framebuffer != 0)
+	{
+		api->DeleteFramebuffers(1, &m_framebuffer);
+		api->DeleteRenderbuffers(1, &m_color);
+		api->DeleteRenderbuffers(1, &m_depth);
+	}
+	m_framebuffer = m_color = m_depth = 0;
+	m_width = m_height = 0;
+}
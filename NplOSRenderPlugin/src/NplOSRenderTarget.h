@@ -0,0 +1,49 @@
+#pragma once
+#include "GL/osmesa.h"
+#include "gl_wrap.h"
+
+/** GL 3.0 framebuffer object entry points, resolved with OSMesaGetProcAddress like ShaderAPI */
+struct FramebufferAPI
+{
+	PFNGLGENFRAMEBUFFERSPROC GenFramebuffers;
+	PFNGLBINDFRAMEBUFFERPROC BindFramebuffer;
+	PFNGLDELETEFRAMEBUFFERSPROC DeleteFramebuffers;
+	PFNGLFRAMEBUFFERRENDERBUFFERPROC FramebufferRenderbuffer;
+	PFNGLCHECKFRAMEBUFFERSTATUSPROC CheckFramebufferStatus;
+	PFNGLGENRENDERBUFFERSPROC GenRenderbuffers;
+	PFNGLBINDRENDERBUFFERPROC BindRenderbuffer;
+	PFNGLRENDERBUFFERSTORAGEPROC RenderbufferStorage;
+	PFNGLDELETERENDERBUFFERSPROC DeleteRenderbuffers;
+
+	/** resolves all entry points on first use, returns nullptr if any of them is missing */
+	static const FramebufferAPI* Get();
+};
+
+/**
+* the color and depth buffers one worker renders into. OSMesa gives all contexts made current on buffers of the same
+* format and size one set of render buffers, so workers drawing frames of the same size at once would draw into and read
+* back each other's pixels. A framebuffer object belongs to its context alone.
+* The views are flipped vertically, so that rows are read back top row first like the PNG.
+*/
+class RenderTarget
+{
+public:
+	RenderTarget();
+
+	/** binds the framebuffer, sized for at least width x height pixels, in the current context. False if it is incomplete */
+	bool Bind(int width, int height);
+	/** copies width x height pixels starting at column x to dst, whose rows are rowLength pixels apart */
+	void Read(int x, int width, int height, unsigned char* dst, int rowLength);
+	/** deletes the framebuffer, the context it was bound in must be current */
+	void Destroy();
+
+private:
+	RenderTarget(const RenderTarget&);
+	RenderTarget& operator=(const RenderTarget&);
+
+	GLuint m_framebuffer;
+	GLuint m_color;
+	GLuint m_depth;
+	int m_width;
+	int m_height;
+};
@@ -0,0 +1,101 @@
+#include "NplOSRenderTransform.h"
+#include <cmath>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define NPLOSRENDER_SSE
+#include <emmintrin.h>
+#endif
+
+using namespace ParaEngine;
+
+void TransformPoints(const Vector3* src, Vector3* dst, size_t count, const Matrix4& m, Vector3& vmin, Vector3& vmax)
+{
+	if (count == 0)
+		return;
+#ifdef NPLOSRENDER_SSE
+	const __m128 row0 = _mm_loadu_ps(&m._m[0]);
+	const __m128 row1 = _mm_loadu_ps(&m._m[4]);
+	const __m128 row2 = _mm_loadu_ps(&m._m[8]);
+	const __m128 row3 = _mm_loadu_ps(&m._m[12]);
+	__m128 bmin = _mm_setr_ps(vmin.x, vmin.y, vmin.z, 0);
+	__m128 bmax = _mm_setr_ps(vmax.x, vmax.y, vmax.z, 0);
+	for (size_t i = 0; i < count; i++)
+	{
+		const Vector3& p = src[i];
+		__m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(p.x), row0), _mm_mul_ps(_mm_set1_ps(p.y), row1)),
+			_mm_add_ps(_mm_mul_ps(_mm_set1_ps(p.z), row2), row3));
+		r = _mm_div_ps(r, _mm_shuffle_ps(r, r, _MM_SHUFFLE(3, 3, 3, 3)));
+		bmin = _mm_min_ps(bmin, r);
+		bmax = _mm_max_ps(bmax, r);
+		if (dst)
+		{
+			float out[4];
+			_mm_storeu_ps(out, r);
+			dst[i].x = out[0];
+			dst[i].y = out[1];
+			dst[i].z = out[2];
+		}
+	}
+	float out[4];
+	_mm_storeu_ps(out, bmin);
+	vmin = Vector3(out[0], out[1], out[2]);
+	_mm_storeu_ps(out, bmax);
+	vmax = Vector3(out[0], out[1], out[2]);
+#else
+	for (size_t i = 0; i < count; i++)
+	{
+		Vector3 point = src[i] * m;
+		if (dst)
+			dst[i] = point;
+		if (point.x > vmax.x) vmax.x = point.x;	if (point.x < vmin.x) vmin.x = point.x;
+		if (point.y > vmax.y) vmax.y = point.y;	if (point.y < vmin.y) vmin.y = point.y;
+		if (point.z > vmax.z) vmax.z = point.z;	if (point.z < vmin.z) vmin.z = point.z;
+	}
+#endif
+}
+
+void TransformNormals(Vector3* normals, size_t count, const Matrix4& m)
+{
+	if (m._11 == 1 && m._12 == 0 && m._13 == 0 &&
+		m._21 == 0 && m._22 == 1 && m._23 == 0 &&
+		m._31 == 0 && m._32 == 0 && m._33 == 1)
+		return;
+
+	// inverse transpose of the upper 3x3 is its cofactor matrix divided by the determinant,
+	// the determinant only scales the result and the sign is kept so that normals keep facing out
+	float c[9] = {
+		m._22 * m._33 - m._23 * m._32, m._23 * m._31 - m._21 * m._33, m._21 * m._32 - m._22 * m._31,
+		m._13 * m._32 - m._12 * m._33, m._11 * m._33 - m._13 * m._31, m._12 * m._31 - m._11 * m._32,
+		m._12 * m._23 - m._13 * m._22, m._13 * m._21 - m._11 * m._23, m._11 * m._22 - m._12 * m._21 };
+	float det = m._11 * c[0] + m._12 * c[1] + m._13 * c[2];
+	if (det == 0)
+		return;
+	if (det < 0)
+		for (int k = 0; k < 9; k++) c[k] = -c[k];
+#ifdef NPLOSRENDER_SSE
+	const __m128 row0 = _mm_setr_ps(c[0], c[1], c[2], 0);
+	const __m128 row1 = _mm_setr_ps(c[3], c[4], c[5], 0);
+	const __m128 row2 = _mm_setr_ps(c[6], c[7], c[8], 0);
+	for (size_t i = 0; i < count; i++)
+	{
+		Vector3& n = normals[i];
+		__m128 r = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(n.x), row0), _mm_mul_ps(_mm_set1_ps(n.y), row1)), _mm_mul_ps(_mm_set1_ps(n.z), row2));
+		__m128 sq = _mm_mul_ps(r, r);
+		__m128 len = _mm_add_ss(_mm_add_ss(sq, _mm_shuffle_ps(sq, sq, _MM_SHUFFLE(1, 1, 1, 1))), _mm_shuffle_ps(sq, sq, _MM_SHUFFLE(2, 2, 2, 2)));
+		len = _mm_sqrt_ss(len);
+		float out[4];
+		_mm_storeu_ps(out, r);
+		float l = _mm_cvtss_f32(len);
+		if (l > 0)
+			n = Vector3(out[0] / l, out[1] / l, out[2] / l);
+	}
+#else
+	for (size_t i = 0; i < count; i++)
+	{
+		Vector3& n = normals[i];
+		Vector3 r(n.x * c[0] + n.y * c[3] + n.z * c[6], n.x * c[1] + n.y * c[4] + n.z * c[7], n.x * c[2] + n.y * c[5] + n.z * c[8]);
+		float l = sqrtf(r.x * r.x + r.y * r.y + r.z * r.z);
+		if (l > 0)
+			n = Vector3(r.x / l, r.y / l, r.z / l);
+	}
+#endif
+}
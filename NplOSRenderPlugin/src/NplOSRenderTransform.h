@@ -0,0 +1,13 @@
+#pragma once
+#include "ParaMath.h"
+#include "ParaVector3.h"
+#include <cstddef>
+
+/**
+* transforms count points by a world matrix (row vector times matrix, divided by w) and grows vmin/vmax
+* by the transformed points. dst may equal src, or be nullptr when only the bounds are needed.
+*/
+void TransformPoints(const ParaEngine::Vector3* src, ParaEngine::Vector3* dst, size_t count, const ParaEngine::Matrix4& m, ParaEngine::Vector3& vmin, ParaEngine::Vector3& vmax);
+
+/** transforms count normals in place by the inverse transpose of the upper 3x3 of m and renormalizes them; nothing is done for a pure translation */
+void TransformNormals(ParaEngine::Vector3* normals, size_t count, const ParaEngine::Matrix4& m);